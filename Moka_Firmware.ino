@@ -68,6 +68,10 @@
 #include "moka_leds.h"
 #include "moka_pad.h"
 #include "moka_twi.h"
+#include "moka_fade.h"
+#include "moka_stats.h"
+#include "moka_sched.h"
+#include "moka_bench.h"
 
 //Constants definition
 //const uint8_t nbLed = 16;
@@ -113,12 +117,20 @@ void setup(){
 
     mw_init();
 
+    //Tasks start once everything is set.
+    mk_init();
 }
 
 void loop(){
 //    test();
-    mp_update();
-//    ml_update();
+    ms_loopStart();
+    MB_BEGIN(MB_LOOP);
+    if(mk_update()){
+        MB_END(MB_LOOP);
+        ms_loopEnd();
+    } else {
+        mk_sleep();
+    }
 }
 
 //Test function
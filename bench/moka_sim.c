@@ -0,0 +1,496 @@
+//Simulator benchmark driver for the moka board
+
+/*
+ * This is a program for timing the moka board firmware in simavr
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Usage: moka_sim firmware.elf [time in ms] [results file]
+// Runs the firmware built with MB_BENCH=1 on an atmega328p at 8MHz, sends it a scripted TWI traffic,
+// and writes the cycles between the GPIOR0 markers of each path, as described in moka_bench.h,
+// to the results file, or to the standard output:
+//		path,command,count,min cycles,max cycles,mean cycles
+// Latencies are timed from the bus event: twi_latency from each byte or condition sent by the master to the end
+// of the TWI interrupt that handled it, per command like twi, and frame_latency from the last byte of an output
+// request, UPDATE_LEDS or LATCH, to the first edge of the next frame on the led data line.
+// Keys are left released, so the keypad scan runs but no key event is timed.
+//
+// The led output is checked against the SK6812 timing, for the bit banged line on PB1 and for the SPI output
+// on MOSI, whichever the firmware uses. High times, low times within a frame and reset times are added as
+// wave_* paths, frames must have 24 bits per led, and each error is printed. The exit code is 1 if any.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_io.h>
+#include <simavr/avr_twi.h>
+#include <simavr/avr_ioport.h>
+
+#define MB_F_CPU 8000000UL
+#define MB_CYCLES_PER_US (MB_F_CPU / 1000000UL)
+
+//GPIOR0, GPIOR1 and SPDR, as data addresses.
+#define MB_GPIOR0 0x3E
+#define MB_GPIOR1 0x4A
+#define MB_SPDR 0x4E
+
+//Bit banged led data pin, PB1.
+#define MB_LED_PIN 1
+
+//Leds on the data line, ML_NUM_LED of the firmware.
+#define MB_NUM_LED 16
+
+//SK6812 timing, in ns: high time of a 0 and of a 1, 0.3 and 0.6us +-0.15us, shortest low time, 0.6us -0.15us,
+//and reset time.
+#define MB_T0H_MIN 150
+#define MB_T0H_MAX 450
+#define MB_T1H_MAX 750
+#define MB_TL_MIN 450
+#define MB_RESET 80000
+
+//SPI bit time, at F_CPU / 2, in cycles.
+#define MB_SPI_BIT_CYCLES 2
+
+//Board address with no jumper closed.
+#define MB_ADDRESS 10
+
+//Time for a TWI byte at 100kHz, 9 bits, in cycles.
+#define MB_TWI_BYTE_CYCLES (90 * MB_CYCLES_PER_US)
+
+//Time between two frames of the script, in us.
+#define MB_FRAME_TIME 10000
+
+//Path ids, from moka_bench.h, then the led output timings and the latencies.
+#define MB_NUM_PATHS 13
+#define MB_TWI 4
+#define MB_WAVE_T0H 7
+#define MB_WAVE_T1H 8
+#define MB_WAVE_LOW 9
+#define MB_WAVE_RESET 10
+#define MB_TWI_LATENCY 11
+#define MB_FRAME_LATENCY 12
+const char *_mb_pathNames[MB_NUM_PATHS] = {
+	"", "pad_update", "led_update", "led_masked", "twi", "pad_scan", "loop",
+	"wave_t0h", "wave_t1h", "wave_low", "wave_reset", "twi_latency", "frame_latency",
+};
+
+struct mb_timing{
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t sum;
+};
+
+//Timings per path, and per command for the TWI interrupt and its latency. Begin times are per path, so paths can nest.
+struct mb_timing _mb_paths[MB_NUM_PATHS];
+struct mb_timing _mb_commands[256];
+struct mb_timing _mb_latencies[256];
+avr_cycle_count_t _mb_begin[MB_NUM_PATHS];
+uint8_t _mb_started[MB_NUM_PATHS];
+
+avr_t *_mb_avr;
+avr_irq_t *_mb_twiInput;
+avr_cycle_count_t _mb_end;
+
+//Last bus event sent to the board, not handled yet by the TWI interrupt.
+avr_cycle_count_t _mb_twiEvent;
+uint8_t _mb_twiPending = 0;
+
+//Last byte of the last output request, until the next frame starts.
+avr_cycle_count_t _mb_lastByte;
+avr_cycle_count_t _mb_outputEvent;
+uint8_t _mb_outputPending = 0;
+
+//Bytes read back from the board by the last read.
+uint8_t _mb_readData[32];
+uint8_t _mb_readCount;
+
+//Led output: level and time of the last edge, bits of the current frame, and errors found.
+uint8_t _mb_waveLevel = 0;
+uint8_t _mb_waveStarted = 0;
+avr_cycle_count_t _mb_waveEdge = 0;
+uint16_t _mb_waveBits = 0;
+uint32_t _mb_waveErrors = 0;
+
+//End of the SPI byte being shifted out.
+avr_cycle_count_t _mb_spiEnd = 0;
+
+void mb_addTiming(struct mb_timing *timing, uint32_t cycles){
+	if((timing->count == 0) || (cycles < timing->min)){
+		timing->min = cycles;
+	}
+	if(cycles > timing->max){
+		timing->max = cycles;
+	}
+	timing->count++;
+	timing->sum += cycles;
+}
+
+// Marker written by the firmware. A registered write has to store the value itself.
+void mb_markerWrite(struct avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param){
+	avr->data[addr] = v;
+
+	uint8_t path = v & 0x7F;
+	if(path >= MB_NUM_PATHS){
+		return;
+	}
+
+	if(!(v & 0x80)){
+		_mb_begin[path] = avr->cycle;
+		_mb_started[path] = 1;
+		return;
+	}
+
+	if(!_mb_started[path]){
+		return;
+	}
+	_mb_started[path] = 0;
+
+	uint32_t cycles = (uint32_t)(avr->cycle - _mb_begin[path]);
+	mb_addTiming(&_mb_paths[path], cycles);
+	if(path != MB_TWI){
+		return;
+	}
+	mb_addTiming(&_mb_commands[avr->data[MB_GPIOR1]], cycles);
+
+	if(_mb_twiPending){
+		_mb_twiPending = 0;
+		uint32_t latency = (uint32_t)(avr->cycle - _mb_twiEvent);
+		mb_addTiming(&_mb_paths[MB_TWI_LATENCY], latency);
+		mb_addTiming(&_mb_latencies[avr->data[MB_GPIOR1]], latency);
+	}
+}
+
+// Convert cycles to ns.
+uint32_t mb_ns(avr_cycle_count_t cycles){
+	return (uint32_t)(cycles * 1000 / MB_CYCLES_PER_US);
+}
+
+void mb_waveError(const char *error, avr_cycle_count_t cycle, avr_cycle_count_t width){
+	if(_mb_waveErrors++ < 20){
+		fprintf(stderr, "led output at cycle %llu: %s, %lu ns\n", (unsigned long long)cycle, error,
+			(unsigned long)mb_ns(width));
+	}
+}
+
+// A frame ends once the line stayed low for the reset time.
+void mb_waveEndFrame(avr_cycle_count_t cycle){
+	if(_mb_waveBits != MB_NUM_LED * 24){
+		fprintf(stderr, "led output at cycle %llu: frame of %u bits\n", (unsigned long long)cycle, _mb_waveBits);
+		_mb_waveErrors++;
+	}
+	_mb_waveBits = 0;
+}
+
+// Edge of the led data line. High times are bits, low times are between bits, or a reset between frames.
+void mb_waveChange(avr_cycle_count_t cycle, uint8_t level){
+	if(level == _mb_waveLevel){
+		return;
+	}
+	avr_cycle_count_t width = cycle - _mb_waveEdge;
+	uint32_t ns = mb_ns(width);
+	_mb_waveLevel = level;
+	_mb_waveEdge = cycle;
+
+	if(!level){
+		_mb_waveBits++;
+		if((ns < MB_T0H_MIN) || (ns > MB_T1H_MAX)){
+			mb_waveError("high time out of range", cycle, width);
+		} else {
+			mb_addTiming(&_mb_paths[(ns < MB_T0H_MAX) ? MB_WAVE_T0H : MB_WAVE_T1H], width);
+		}
+		return;
+	}
+
+	// The first frame starts after setup(), with no timing before it.
+	if(!_mb_waveStarted){
+		_mb_waveStarted = 1;
+		return;
+	}
+
+	if(ns >= MB_RESET){
+		mb_addTiming(&_mb_paths[MB_WAVE_RESET], width);
+		mb_waveEndFrame(cycle);
+
+		if(_mb_outputPending){
+			_mb_outputPending = 0;
+			mb_addTiming(&_mb_paths[MB_FRAME_LATENCY], (uint32_t)(cycle - _mb_outputEvent));
+		}
+	} else if(ns < MB_TL_MIN){
+		mb_waveError("low time too short", cycle, width);
+	} else {
+		mb_addTiming(&_mb_paths[MB_WAVE_LOW], width);
+	}
+}
+
+// Bit banged led data pin.
+void mb_ledPin(struct avr_irq_t *irq, uint32_t value, void *param){
+	mb_waveChange(_mb_avr->cycle, value != 0);
+}
+
+// SPI data register. simavr doesn't shift the bits out on MOSI, so the line is rebuilt from the bytes written:
+// MSB first, one bit every 2 cycles at F_CPU / 2. A byte written before the previous one is out is an error,
+// the SPI would drop it. A registered write has to store the value itself.
+void mb_spiWrite(struct avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param){
+	avr->data[addr] = v;
+
+	avr_cycle_count_t cycle = avr->cycle;
+	if(cycle < _mb_spiEnd){
+		mb_waveError("SPI byte written while shifting", cycle, _mb_spiEnd - cycle);
+		return;
+	}
+
+	for(uint8_t i = 0; i < 8; i++){
+		mb_waveChange(cycle + i * MB_SPI_BIT_CYCLES, (v >> (7 - i)) & 0x01);
+	}
+	_mb_spiEnd = cycle + 8 * MB_SPI_BIT_CYCLES;
+}
+
+// Bytes sent back by the board as a slave transmitter.
+void mb_twiOutput(struct avr_irq_t *irq, uint32_t value, void *param){
+	avr_twi_msg_irq_t msg;
+	msg.u.v = value;
+
+	if((msg.u.twi.msg & TWI_COND_READ) && (_mb_readCount < sizeof(_mb_readData))){
+		_mb_readData[_mb_readCount++] = msg.u.twi.data;
+	}
+}
+
+// Run the board until the given cycle. Stops the benchmark if the firmware ends or crashes.
+void mb_runUntil(avr_cycle_count_t cycle){
+	while(_mb_avr->cycle < cycle){
+		int state = avr_run(_mb_avr);
+		if((state == cpu_Done) || (state == cpu_Crashed)){
+			fprintf(stderr, "firmware stopped at cycle %llu\n", (unsigned long long)_mb_avr->cycle);
+			exit(1);
+		}
+	}
+}
+
+// Send a TWI condition to the board, and let the bus time go on.
+void mb_twiSend(uint8_t condition, uint8_t address, uint8_t data){
+	_mb_twiEvent = _mb_avr->cycle;
+	_mb_twiPending = 1;
+	avr_raise_irq(_mb_twiInput, avr_twi_irq_msg(condition, address, data));
+	mb_runUntil(_mb_avr->cycle + MB_TWI_BYTE_CYCLES);
+}
+
+// Write to the board, or to all boards with address 0.
+void mb_twiWrite(uint8_t address, const uint8_t *data, uint8_t length){
+	mb_twiSend(TWI_COND_START | TWI_COND_ADDR | TWI_COND_WRITE, address << 1, 0);
+	for(uint8_t i = 0; i < length; i++){
+		_mb_lastByte = _mb_avr->cycle;
+		mb_twiSend(TWI_COND_WRITE, address << 1, data[i]);
+	}
+	mb_twiSend(TWI_COND_STOP, address << 1, 0);
+}
+
+// Write ending with an output request: the next frame is timed from its last byte.
+void mb_twiRequest(uint8_t address, const uint8_t *data, uint8_t length){
+	mb_twiWrite(address, data, length);
+	_mb_outputEvent = _mb_lastByte;
+	_mb_outputPending = 1;
+}
+
+// Read from the board. The master acknowledges each byte but the last one.
+void mb_twiRead(uint8_t address, uint8_t length){
+	_mb_readCount = 0;
+	mb_twiSend(TWI_COND_START | TWI_COND_ADDR | TWI_COND_READ, (address << 1) | 1, 0);
+	for(uint8_t i = 0; i < length; i++){
+		mb_twiSend(TWI_COND_READ | ((i < length - 1) ? TWI_COND_ACK : 0), (address << 1) | 1, 0);
+	}
+	mb_twiSend(TWI_COND_STOP, (address << 1) | 1, 0);
+}
+
+// Command then read, in two transactions.
+void mb_twiQuery(uint8_t command, uint8_t length){
+	mb_twiWrite(MB_ADDRESS, &command, 1);
+	mb_twiRead(MB_ADDRESS, length);
+}
+
+// The script. Each frame time, the master sends a frame and polls the buttons. Less often, it changes
+// the settings, fades, uses the palette, latches all boards and reads the statistics.
+// Command values are from moka_twi.cpp.
+void mb_runScript(){
+	uint8_t data[64];
+	uint32_t frame = 0;
+	avr_cycle_count_t start = _mb_avr->cycle;
+
+	const uint8_t init[] = {0x85, 0x50, 0xFF, 0xFF};
+	mb_twiWrite(MB_ADDRESS, init, sizeof(init));
+
+	while(_mb_avr->cycle < _mb_end){
+		if(frame & 0x03){
+			// Delta frame, 3 leds.
+			uint8_t length = 0;
+			data[length++] = 0x30;
+			data[length++] = 0x01 << (frame & 0x07);
+			data[length++] = 0x11;
+			for(uint8_t i = 0; i < 9; i++){
+				data[length++] = frame + 20 * i;
+			}
+			data[length++] = 0xF5;
+			mb_twiRequest(MB_ADDRESS, data, length);
+		} else {
+			// Full 24 bits frame.
+			data[0] = 0x20;
+			for(uint8_t i = 0; i < 48; i++){
+				data[1 + i] = frame * 3 + i;
+			}
+			data[49] = 0xF5;
+			mb_twiRequest(MB_ADDRESS, data, 50);
+		}
+
+		mb_twiQuery(0x40, 2);
+
+		if((frame % 50) == 10){
+			// Settings batch, LED_STATE to BLINK_MASK, then UPDATE_LEDS.
+			const uint8_t batch[] = {0x50, 0xFF, 0xFF, 0x61, 0x70, 0x51, 200, 0x80, 0x01, 0xF4,
+				0x81, 0x01, 0xF4, 0x82, 3, 0x8A, 0x00, 0x00, 0xF5};
+			mb_twiRequest(MB_ADDRESS, batch, sizeof(batch));
+		}
+
+		if((frame % 50) == 20){
+			// Palette: colors, a palette frame, then back to 24 bits.
+			data[0] = 0xC0;
+			for(uint8_t i = 0; i < 48; i++){
+				data[1 + i] = i * 5;
+			}
+			mb_twiWrite(MB_ADDRESS, data, 49);
+			const uint8_t palette[] = {0x86, 0x20, 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF, 0xF5};
+			mb_twiRequest(MB_ADDRESS, palette, sizeof(palette));
+			const uint8_t mode24 = 0x85;
+			mb_twiWrite(MB_ADDRESS, &mode24, 1);
+		}
+
+		if((frame % 50) == 30){
+			// Fade of all leds, 500ms.
+			data[0] = 0xB0;
+			data[1] = 0x01;
+			data[2] = 0x01;
+			data[3] = 0xF4;
+			for(uint8_t i = 0; i < 48; i++){
+				data[4 + i] = 255 - i;
+			}
+			mb_twiWrite(MB_ADDRESS, data, 52);
+		}
+
+		if((frame % 8) == 4){
+			// General call latch.
+			const uint8_t latch[] = {0x8B, (uint8_t)frame};
+			mb_twiRequest(0, latch, sizeof(latch));
+		}
+
+		if((frame % 100) == 99){
+			mb_twiQuery(0x8D, 14);
+		}
+
+		frame++;
+		mb_runUntil(start + (avr_cycle_count_t)frame * MB_FRAME_TIME * MB_CYCLES_PER_US);
+	}
+}
+
+void mb_printTiming(FILE *results, const char *path, const char *command, const struct mb_timing *timing){
+	fprintf(results, "%s,%s,%lu,%lu,%lu,%lu\n", path, command,
+		(unsigned long)timing->count, (unsigned long)timing->min, (unsigned long)timing->max,
+		(unsigned long)(timing->sum / timing->count));
+}
+
+int main(int argc, char *argv[]){
+	if(argc < 2){
+		fprintf(stderr, "usage: %s firmware.elf [time in ms] [results file]\n", argv[0]);
+		return 2;
+	}
+	uint32_t time = (argc > 2) ? strtoul(argv[2], NULL, 0) : 2000;
+
+	elf_firmware_t firmware;
+	memset(&firmware, 0, sizeof(firmware));
+	if(elf_read_firmware(argv[1], &firmware) != 0){
+		fprintf(stderr, "can't read %s\n", argv[1]);
+		return 1;
+	}
+
+	_mb_avr = avr_make_mcu_by_name("atmega328p");
+	if(_mb_avr == NULL){
+		fprintf(stderr, "simavr has no atmega328p\n");
+		return 1;
+	}
+	avr_init(_mb_avr);
+	avr_load_firmware(_mb_avr, &firmware);
+	_mb_avr->frequency = MB_F_CPU;
+
+	avr_register_io_write(_mb_avr, MB_GPIOR0, mb_markerWrite, NULL);
+	_mb_twiInput = avr_io_getirq(_mb_avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_INPUT);
+	avr_irq_register_notify(avr_io_getirq(_mb_avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_OUTPUT), mb_twiOutput, NULL);
+	avr_irq_register_notify(avr_io_getirq(_mb_avr, AVR_IOCTL_IOPORT_GETIRQ('B'), MB_LED_PIN), mb_ledPin, NULL);
+	avr_register_io_write(_mb_avr, MB_SPDR, mb_spiWrite, NULL);
+
+	// Let setup() run before the traffic starts.
+	mb_runUntil(100000UL * MB_CYCLES_PER_US);
+	_mb_end = _mb_avr->cycle + (avr_cycle_count_t)time * 1000 * MB_CYCLES_PER_US;
+	mb_runScript();
+
+	// The last frame ends if the line is low for the reset time.
+	if(_mb_waveStarted && !_mb_waveLevel && (mb_ns(_mb_avr->cycle - _mb_waveEdge) >= MB_RESET)){
+		mb_waveEndFrame(_mb_avr->cycle);
+	}
+	if(_mb_paths[MB_WAVE_RESET].count == 0){
+		fprintf(stderr, "led output: no frame\n");
+		_mb_waveErrors++;
+	}
+
+	FILE *results = stdout;
+	if(argc > 3){
+		results = fopen(argv[3], "w");
+		if(results == NULL){
+			fprintf(stderr, "can't write %s\n", argv[3]);
+			return 1;
+		}
+	}
+
+	fprintf(results, "path,command,count,min cycles,max cycles,mean cycles\n");
+	for(uint8_t path = 1; path < MB_NUM_PATHS; path++){
+		if(_mb_paths[path].count == 0){
+			continue;
+		}
+		mb_printTiming(results, _mb_pathNames[path], "", &_mb_paths[path]);
+
+		const struct mb_timing *commands;
+		if(path == MB_TWI){
+			commands = _mb_commands;
+		} else if(path == MB_TWI_LATENCY){
+			commands = _mb_latencies;
+		} else {
+			continue;
+		}
+		for(uint16_t command = 0; command < 256; command++){
+			if(commands[command].count){
+				char name[8];
+				snprintf(name, sizeof(name), "0x%02X", command);
+				mb_printTiming(results, _mb_pathNames[path], name, &commands[command]);
+			}
+		}
+	}
+	if(results != stdout){
+		fclose(results);
+	}
+
+	return _mb_waveErrors ? 1 : 0;
+}
@@ -0,0 +1,63 @@
+//Benchmark markers for the moka board
+
+/*
+ * This is a library for timing the moka board firmware hot paths in a simulator
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOKA_BENCH_H
+#define MOKA_BENCH_H
+
+#include "moka_hal.h"
+
+// Hot paths write a marker to GPIOR0 when they begin and end: the path id, or'ed with 0x80 at the end.
+// GPIOR0 is a general purpose I/O register, so a marker is a single out instruction, and nothing is wired to it.
+// The TWI interrupt also writes the command being received to GPIOR1, before its end marker.
+//
+// bench/ builds the firmware for the board (atmega328p at 8MHz, see avr/boards.txt) with MB_BENCH set to 1,
+// and runs it in simavr with scripted TWI traffic and a watch on GPIOR0 and GPIOR1: make -C bench run
+// The cycle count between a begin and its end marker is the path cost, interrupts included,
+// and TWI interrupts are grouped by the GPIOR1 value, i.e. by command.
+// The bench also times latencies from the bus event: from each TWI byte to the end of its interrupt,
+// and from the last byte of an output request to the next frame on the led line.
+// Results go to bench/results-output<ML_OUTPUT>.csv, one line per path, or per path and command, comma separated:
+//		path,command,count,min cycles,max cycles,mean cycles
+// The command field is empty for paths other than the TWI interrupt and its latency.
+//
+// Markers are compiled out by default.
+#ifndef MB_BENCH
+#define MB_BENCH 0
+#endif
+
+//Path ids
+const uint8_t MB_PAD_UPDATE = 1;	// pad task: mp_update(), key rules and gestures
+const uint8_t MB_LED_UPDATE = 2;	// ml_update(), frame included when one is sent
+const uint8_t MB_LED_MASKED = 3;	// interrupts masked while the frame is bit banged
+const uint8_t MB_TWI = 4;			// TWI interrupt, per received byte
+const uint8_t MB_PAD_SCAN = 5;		// timer 2 interrupt, keypad scan
+const uint8_t MB_LOOP = 6;			// loop pass that ran tasks, sleep excluded. Passes that only sleep have no end.
+
+#if MB_BENCH
+#define MB_BEGIN(path) (GPIOR0 = (path))
+#define MB_END(path) (GPIOR0 = (path) | 0x80)
+#define MB_VALUE(value) (GPIOR1 = (value))
+#else
+#define MB_BEGIN(path)
+#define MB_END(path)
+#define MB_VALUE(value)
+#endif
+
+#endif
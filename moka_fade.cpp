@@ -0,0 +1,158 @@
+//Led fading for the moka board
+
+/*
+ * This is a library for fading Moka leds from a color to another.
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "moka_fade.h"
+
+// Each led can fade from its current color to a target color, over a duration and with an easing curve.
+// Fades are computed on the board, at a fixed frame rate, so the master only sends the target once.
+//
+// Progress of a fade is a 16 bits fixed point value, from 0 to 0xFFFF. The step per ms is computed when
+// the fade starts, so a frame only needs multiplications and shifts.
+
+//Start and target colors of the running fades, GRB.
+uint8_t _mf_from[NUM_LED][3];
+uint8_t _mf_target[NUM_LED][3];
+
+//Targets received for the next fades, GRB. They are written from the TWI interrupt, and taken when a fade starts,
+//so a running fade keeps its target until the command of the next one is executed.
+uint8_t _mf_next[NUM_LED][3];
+
+//Progress, progress step per ms and easing of each fade.
+uint16_t _mf_position[NUM_LED];
+uint16_t _mf_step[NUM_LED];
+uint8_t _mf_easing[NUM_LED];
+
+//Leds being faded, one bit per led.
+ml_leds _mf_active = 0;
+
+//Time of the last frame.
+uint32_t _mf_time = 0;
+
+//Set the target color of a led, for the next fade.
+void mf_setTarget(uint8_t ledId, uint8_t rChannel, uint8_t gChannel, uint8_t bChannel){
+	_mf_next[ledId][0] = gChannel;
+	_mf_next[ledId][1] = rChannel;
+	_mf_next[ledId][2] = bChannel;
+}
+
+//Start a fade from the current color of the led to its target color. Duration is in ms.
+//A null duration sets the target color at once.
+void mf_start(uint8_t ledId, uint16_t duration, uint8_t easing){
+	uint8_t sreg = SREG;
+	cli();
+	memcpy(_mf_target[ledId], _mf_next[ledId], 3);
+	SREG = sreg;
+
+	if(duration == 0){
+		mf_stop(ledId);
+		ml_setColor(ledId, _mf_target[ledId][1], _mf_target[ledId][0], _mf_target[ledId][2]);
+		return;
+	}
+
+	uint32_t color = ml_getColor(ledId);
+	_mf_from[ledId][0] = (uint8_t)(color >> 8);
+	_mf_from[ledId][1] = (uint8_t)(color >> 16);
+	_mf_from[ledId][2] = (uint8_t)color;
+
+	_mf_position[ledId] = 0;
+	// Rounded up, so the fade is over after its duration.
+	_mf_step[ledId] = (0xFFFFUL + duration - 1) / duration;
+	_mf_easing[ledId] = easing;
+
+	// The first frame of a fade is one frame time after the other fades, or after now.
+	if(_mf_active == 0){
+		_mf_time = millis();
+	}
+	_mf_active |= ML_LED(ledId);
+}
+
+//Stop the fade of a led, leaving it to its current color.
+void mf_stop(uint8_t ledId){
+	_mf_active &= ~ML_LED(ledId);
+}
+
+//Tell if some leds are being faded.
+bool mf_isFading(){
+	return _mf_active != 0;
+}
+
+//Apply the easing curve to a progress from 0 to 255.
+uint8_t mf_ease(uint8_t t, uint8_t easing){
+	uint8_t u = 255 - t;
+	switch(easing){
+		case MF_EASE_IN:
+			return ((uint16_t)t * t) >> 8;
+		case MF_EASE_OUT:
+			return 255 - (((uint16_t)u * u) >> 8);
+		case MF_EASE_IN_OUT:
+			// Smoothstep: 3t² - 2t³
+			return ((uint32_t)t * t * (768 - 2 * (uint16_t)t)) >> 16;
+		case MF_EASE_LINEAR:
+		default:
+			return t;
+	}
+}
+
+//Compute a channel between from and to, for an eased progress from 0 to 255.
+uint8_t mf_interpolate(uint8_t from, uint8_t to, uint8_t e){
+	if(to >= from){
+		return from + (((uint16_t)(to - from) * e) >> 8);
+	} else {
+		return from - (((uint16_t)(from - to) * e) >> 8);
+	}
+}
+
+//Compute the next frame of the running fades. To be called from the loop.
+//Leds are marked as changed, and sent on next ml_update().
+void mf_update(){
+	if(_mf_active == 0){
+		return;
+	}
+
+	uint32_t now = millis();
+	uint16_t elapsed = now - _mf_time;
+	if(elapsed < MF_FRAME_TIME){
+		return;
+	}
+	_mf_time = now;
+
+	ml_leds mask = 1;
+	for(uint8_t i = 0; i < NUM_LED; i++, mask <<= 1){
+		if(!(_mf_active & mask)){
+			continue;
+		}
+
+		uint32_t position = (uint32_t)_mf_position[i] + (uint32_t)_mf_step[i] * elapsed;
+
+		// Fade is over, the led gets its target color.
+		if(position >= 0xFFFF){
+			_mf_active &= ~mask;
+			ml_setColor(i, _mf_target[i][1], _mf_target[i][0], _mf_target[i][2]);
+			continue;
+		}
+
+		_mf_position[i] = position;
+		uint8_t e = mf_ease(position >> 8, _mf_easing[i]);
+
+		ml_setColor(i, mf_interpolate(_mf_from[i][1], _mf_target[i][1], e),
+				mf_interpolate(_mf_from[i][0], _mf_target[i][0], e),
+				mf_interpolate(_mf_from[i][2], _mf_target[i][2], e));
+	}
+}
@@ -0,0 +1,48 @@
+//Led fading for the moka board
+
+/*
+ * This is a library for fading Moka leds from a color to another.
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOKA_FADE_H
+#define MOKA_FADE_H
+
+#include "moka_hal.h"
+
+#include "moka_leds.h"
+
+//Easing curves
+const uint8_t MF_EASE_LINEAR = 0;
+const uint8_t MF_EASE_IN = 1;
+const uint8_t MF_EASE_OUT = 2;
+const uint8_t MF_EASE_IN_OUT = 3;
+
+//Time between two fade frames, in ms. 20ms is 50 frames per second.
+const uint8_t MF_FRAME_TIME = 20;
+
+//The targets of the next fades, stored as GRB like the led table, so the TWI driver can stream them the same way.
+extern uint8_t _mf_next[NUM_LED][3];
+
+void mf_setTarget(uint8_t ledId, uint8_t rChannel, uint8_t gChannel, uint8_t bChannel);
+void mf_start(uint8_t ledId, uint16_t duration, uint8_t easing);
+void mf_stop(uint8_t ledId);
+
+bool mf_isFading();
+
+void mf_update();
+
+#endif
@@ -0,0 +1,136 @@
+//Key gestures for the moka board
+
+/*
+ * This is a library for detecting gestures on the Moka keys
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "moka_gesture.h"
+
+#include "moka_pad.h"
+
+// Gestures are detected on the board from the debounced key state, and logged in the event buffer
+// with the presses and releases, so their timing doesn't depend on how often the master polls.
+// mg_update() is called after each scan, so times are accurate to the scan period.
+// A tap is a press shorter than the long press time. A press starting within the double tap time
+// after the release of a tap is a double tap. Its own release doesn't start another one.
+// Times are the low 16 bits of millis(), like event timestamps.
+
+uint8_t _mg_gestures = 0;
+
+uint16_t _mg_longTime = MG_LONG_TIME;
+uint16_t _mg_doubleTime = MG_DOUBLE_TIME;
+uint16_t _mg_repeatDelay = MG_REPEAT_DELAY;
+uint16_t _mg_repeatPeriod = MG_REPEAT_PERIOD;
+
+//Key state seen at the last update, pressed keys are set.
+mp_keys _mg_buttons = 0;
+
+//Keys which long press was logged, keys which press was a double tap, and keys released after a tap.
+mp_keys _mg_long = 0;
+mp_keys _mg_double = 0;
+mp_keys _mg_tap = 0;
+
+//Time of the last press, or of the last release for a tap, and time of the next repeat.
+uint16_t _mg_time[MP_NUM_KEYS];
+uint16_t _mg_repeat[MP_NUM_KEYS];
+
+//Set the gestures logged.
+void mg_setGestures(uint8_t gestures){
+	_mg_gestures = gestures;
+}
+
+//Get the gestures logged.
+uint8_t mg_getGestures(){
+	return _mg_gestures;
+}
+
+//Set the long press time, in ms.
+void mg_setLongTime(uint16_t time){
+	_mg_longTime = time;
+}
+
+//Set the longest time between the release of a tap and the next press for a double tap, in ms.
+void mg_setDoubleTime(uint16_t time){
+	_mg_doubleTime = time;
+}
+
+//Set the time from the press to the first repeat, in ms.
+void mg_setRepeatDelay(uint16_t time){
+	_mg_repeatDelay = time;
+}
+
+//Set the time between two repeats, in ms. It can't be null.
+void mg_setRepeatPeriod(uint16_t time){
+	_mg_repeatPeriod = (time == 0) ? 1 : time;
+}
+
+// Update gestures from the debounced key state, pressed keys set. To be called after each scan.
+void mg_update(mp_keys buttons){
+	mp_keys changed = buttons ^ _mg_buttons;
+	_mg_buttons = buttons;
+
+	if(!_mg_gestures || !(changed | buttons | _mg_tap)){
+		return;
+	}
+
+	uint16_t now = millis();
+	mp_keys mask = 1;
+	for(uint8_t i = 0; i < MP_NUM_KEYS; i++, mask <<= 1){
+		uint16_t elapsed = now - _mg_time[i];
+
+		if(changed & mask){
+			if(buttons & mask){
+				_mg_long &= ~mask;
+				_mg_double &= ~mask;
+				if((_mg_tap & mask) && (elapsed <= _mg_doubleTime)){
+					_mg_double |= mask;
+					if(_mg_gestures & MG_DOUBLE){
+						mp_pushEvent(i, MP_EVENT_DOUBLE, now);
+					}
+				}
+				_mg_tap &= ~mask;
+				_mg_time[i] = now;
+				_mg_repeat[i] = now + _mg_repeatDelay;
+
+			} else {
+				if(_mg_gestures & MG_HELD){
+					mp_pushEvent(i, MP_EVENT_HELD, elapsed);
+				}
+				if((elapsed < _mg_longTime) && !(_mg_double & mask)){
+					_mg_tap |= mask;
+					_mg_time[i] = now;
+				}
+			}
+
+		} else if(buttons & mask){
+			if(!(_mg_long & mask) && (elapsed >= _mg_longTime)){
+				_mg_long |= mask;
+				if(_mg_gestures & MG_LONG){
+					mp_pushEvent(i, MP_EVENT_LONG, now);
+				}
+			}
+			// The repeat time can be ahead of now, so the difference is signed.
+			if((_mg_gestures & MG_REPEAT) && ((int16_t)(now - _mg_repeat[i]) >= 0)){
+				_mg_repeat[i] += _mg_repeatPeriod;
+				mp_pushEvent(i, MP_EVENT_REPEAT, now);
+			}
+
+		} else if((_mg_tap & mask) && (elapsed > _mg_doubleTime)){
+			_mg_tap &= ~mask;
+		}
+	}
+}
@@ -0,0 +1,49 @@
+//Key gestures for the moka board
+
+/*
+ * This is a library for detecting gestures on the Moka keys
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOKA_GESTURE_H
+#define MOKA_GESTURE_H
+
+#include "moka_hal.h"
+
+#include "moka_pad.h"
+
+//Gestures that are logged, one bit each. None are by default, so the event buffer only holds presses and releases.
+const uint8_t MG_LONG = 0x01;		// key held longer than the long press time, once per press
+const uint8_t MG_DOUBLE = 0x02;		// second press of a double tap
+const uint8_t MG_REPEAT = 0x04;		// key held, after the repeat delay then every repeat period
+const uint8_t MG_HELD = 0x08;		// hold duration, after each release
+
+//Default thresholds, in ms.
+const uint16_t MG_LONG_TIME = 500;
+const uint16_t MG_DOUBLE_TIME = 250;
+const uint16_t MG_REPEAT_DELAY = 500;
+const uint16_t MG_REPEAT_PERIOD = 100;
+
+void mg_setGestures(uint8_t gestures);
+uint8_t mg_getGestures();
+void mg_setLongTime(uint16_t time);
+void mg_setDoubleTime(uint16_t time);
+void mg_setRepeatDelay(uint16_t time);
+void mg_setRepeatPeriod(uint16_t time);
+
+void mg_update(mp_keys buttons);
+
+#endif
@@ -0,0 +1,41 @@
+//Hardware abstraction for the moka board
+
+/*
+ * This is a library for building the moka board firmware on the board, or natively on a host
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOKA_HAL_H
+#define MOKA_HAL_H
+
+// The firmware talks to the hardware through its registers, SREG, cli(), ISR() and the Arduino timing functions.
+// On the board they are the real ones, from the Arduino core and avr-libc.
+// On a host they are emulated by moka_hal_host, so the modules build and run natively, unchanged.
+// Only the bit banged led output is AVR assembly, and has a host version in moka_leds.cpp.
+
+#ifdef __AVR__
+
+#include <Arduino.h>
+#include <avr/sleep.h>
+#include <util/twi.h>
+
+#else
+
+#include "moka_hal_host.h"
+
+#endif
+
+#endif
@@ -0,0 +1,207 @@
+//Host emulation of the moka board hardware
+
+/*
+ * This is a library for building the moka board firmware natively on a host
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// This file is empty on the board.
+#ifndef __AVR__
+
+#include "moka_hal.h"
+#include "moka_leds.h"
+
+// The emulation runs at the board clock.
+const uint8_t MH_HOST_CYCLES_PER_US = F_CPU / 1000000UL;
+
+volatile uint8_t SREG = 0x80;
+
+volatile uint8_t PORTB, DDRB;
+volatile uint8_t PORTC, DDRC;
+volatile uint8_t PORTD, DDRD;
+
+volatile uint8_t GPIOR0, GPIOR1, GPIOR2;
+
+volatile uint8_t TCCR2A, TCCR2B, TCNT2, TIMSK2, OCR2A;
+
+volatile uint8_t SPCR, SPSR = _BV(SPIF), SPDR;
+
+volatile uint8_t TWAR, TWCR, TWSR, TWDR;
+
+//Emulated time in us, and cycles counted by timer 2 since its last compare match.
+uint32_t _mh_hostTime = 0;
+uint32_t _mh_hostTimer2 = 0;
+
+//Keys pressed, one bit per key, and address jumpers closed, one bit per jumper.
+uint16_t _mh_hostKeys = 0;
+uint8_t _mh_hostJumpers = 0;
+
+//The frame being sent to the leds, and the last one sent, 3 bytes per led.
+const uint16_t MH_HOST_FRAME_SIZE = NUM_LED * 3;
+uint8_t _mh_hostLedBuffer[MH_HOST_FRAME_SIZE];
+uint8_t _mh_hostFrame[MH_HOST_FRAME_SIZE];
+uint16_t _mh_hostLedCount = 0;
+uint32_t _mh_hostFrameCount = 0;
+
+//Timer 2 prescaler for each clock select value.
+const uint16_t _mh_hostPrescaler[8] = {0, 1, 8, 32, 64, 128, 256, 1024};
+
+// Put the hardware back in its reset state. The firmware state is not reset.
+void mh_hostReset(){
+	SREG = 0x80;
+	PORTB = DDRB = PORTC = DDRC = PORTD = DDRD = 0;
+	TCCR2A = TCCR2B = TCNT2 = TIMSK2 = OCR2A = 0;
+	SPCR = SPDR = 0;
+	SPSR = _BV(SPIF);
+	TWAR = TWCR = TWSR = TWDR = 0;
+
+	_mh_hostTime = 0;
+	_mh_hostTimer2 = 0;
+	_mh_hostKeys = 0;
+	_mh_hostJumpers = 0;
+	_mh_hostLedCount = 0;
+	_mh_hostFrameCount = 0;
+	memset(_mh_hostFrame, 0, MH_HOST_FRAME_SIZE);
+}
+
+// Let the time go on. Timer 2 compare interrupts fire on their time, when they are enabled.
+void mh_hostAdvance(uint32_t us){
+	_mh_hostTime += us;
+
+	uint16_t prescaler = _mh_hostPrescaler[TCCR2B & 0x07];
+	if((prescaler == 0) || !(TIMSK2 & _BV(OCIE2A))){
+		return;
+	}
+
+	uint32_t period = (uint32_t)(OCR2A + 1) * prescaler;
+	_mh_hostTimer2 += us * MH_HOST_CYCLES_PER_US;
+	while(_mh_hostTimer2 >= period){
+		_mh_hostTimer2 -= period;
+		if(SREG & 0x80){
+			TIMER2_COMPA_vect();
+		}
+	}
+}
+
+unsigned long millis(){
+	return _mh_hostTime / 1000;
+}
+
+unsigned long micros(){
+	return _mh_hostTime;
+}
+
+void delay(unsigned long ms){
+	mh_hostAdvance(ms * 1000);
+}
+
+// Keypad matrix. A key links a row, driven low when its DDRD bit is set, to a column on PC0 to PC3, pulled up.
+// Key n is on row n / 4 and column n % 4. TWI lines are idle high.
+void mh_hostSetKeys(uint16_t keys){
+	_mh_hostKeys = keys;
+}
+
+uint8_t mh_hostPinC(){
+	uint8_t columns = 0x0F;
+	for(uint8_t row = 0; row < 4; row++){
+		if(DDRD & _BV(row)){
+			columns &= ~(uint8_t)(_mh_hostKeys >> (4 * row));
+		}
+	}
+	return 0x30 | (columns & 0x0F);
+}
+
+// Address jumpers, pulled up: addr0 to addr3 on PD4 to PD7, addr4 on PB0. A closed jumper reads low.
+void mh_hostSetJumpers(uint8_t jumpers){
+	_mh_hostJumpers = jumpers;
+}
+
+uint8_t mh_hostPinD(){
+	return (PORTD & 0x0F) | (~(_mh_hostJumpers << 4) & 0xF0);
+}
+
+uint8_t mh_hostPinB(){
+	return (PORTB & 0xFE) | ((_mh_hostJumpers & 0x10) ? 0 : 0x01);
+}
+
+// Scripted TWI master. A transaction is addressed to the slave address, or to 0 for a general call.
+// Returns false when the slave doesn't acknowledge its address.
+bool mh_hostTwiWrite(uint8_t address, const uint8_t *data, uint8_t length){
+	bool generalCall = (address == 0);
+	if(!(TWCR & _BV(TWEA)) || (generalCall ? !(TWAR & _BV(TWGCE)) : ((TWAR >> 1) != address))){
+		return false;
+	}
+
+	mh_hostAdvance(MH_HOST_TWI_BYTE_TIME);
+	TWSR = generalCall ? TW_SR_GCALL_ACK : TW_SR_SLA_ACK;
+	TWI_vect();
+
+	for(uint8_t i = 0; i < length; i++){
+		mh_hostAdvance(MH_HOST_TWI_BYTE_TIME);
+		TWDR = data[i];
+		TWSR = generalCall ? TW_SR_GCALL_DATA_ACK : TW_SR_DATA_ACK;
+		TWI_vect();
+	}
+
+	TWSR = TW_SR_STOP;
+	TWI_vect();
+
+	return true;
+}
+
+// The master acknowledges each byte but the last one.
+bool mh_hostTwiRead(uint8_t address, uint8_t *data, uint8_t length){
+	if(!(TWCR & _BV(TWEA)) || ((TWAR >> 1) != address) || (length == 0)){
+		return false;
+	}
+
+	mh_hostAdvance(MH_HOST_TWI_BYTE_TIME);
+	TWSR = TW_ST_SLA_ACK;
+	TWI_vect();
+
+	for(uint8_t i = 0; i < length; i++){
+		mh_hostAdvance(MH_HOST_TWI_BYTE_TIME);
+		data[i] = TWDR;
+		TWSR = (i == length - 1) ? TW_ST_DATA_NACK : TW_ST_DATA_ACK;
+		TWI_vect();
+	}
+
+	return true;
+}
+
+// Led output, called by ml_send() for each byte, then at the end of the frame.
+void mh_hostLedByte(uint8_t data){
+	if(_mh_hostLedCount < MH_HOST_FRAME_SIZE){
+		_mh_hostLedBuffer[_mh_hostLedCount++] = data;
+	}
+}
+
+void mh_hostLedEnd(){
+	memcpy(_mh_hostFrame, _mh_hostLedBuffer, MH_HOST_FRAME_SIZE);
+	_mh_hostLedCount = 0;
+	_mh_hostFrameCount++;
+}
+
+// Get the last frame sent, as GRB bytes, and the number of frames sent.
+const uint8_t *mh_hostGetFrame(){
+	return _mh_hostFrame;
+}
+
+uint32_t mh_hostGetFrameCount(){
+	return _mh_hostFrameCount;
+}
+
+#endif
@@ -0,0 +1,154 @@
+//Host emulation of the moka board hardware
+
+/*
+ * This is a library for building the moka board firmware natively on a host
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOKA_HAL_HOST_H
+#define MOKA_HAL_HOST_H
+
+// Host build, for tests and benchmarks without a board:
+//		g++ -std=gnu++11 -I. moka_*.cpp my_harness.cpp
+// The harness can include Moka_Firmware.ino to get setup() and loop().
+// The host tests in test/ are built this way, and run with: make -C test check
+//
+// Registers are plain variables, except the input pins, that are computed from the virtual hardware:
+// a keypad matrix, and the address jumpers.
+// Time only goes on with mh_hostAdvance(), which fires the timer 2 interrupt as the hardware would.
+// The TWI master is scripted: it sets the TWI status and data registers, and calls the TWI interrupt for each step.
+// Frames sent to the leds are captured, as the bytes on the wire.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define _BV(bit) (1 << (bit))
+#define bit_is_set(sfr, bit) ((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!((sfr) & _BV(bit)))
+
+//The board clock.
+#ifndef F_CPU
+#define F_CPU 8000000UL
+#endif
+
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+#define pgm_read_ptr(address) (*(void * const *)(address))
+
+#define ISR(vector) void vector()
+void TIMER2_COMPA_vect();
+void TWI_vect();
+
+//Status register and interrupts. Interrupts are never nested on the host, the flag is only kept.
+extern volatile uint8_t SREG;
+inline void cli(){ SREG &= ~0x80; }
+inline void sei(){ SREG |= 0x80; }
+
+//Ports. Input pins read the virtual hardware.
+extern volatile uint8_t PORTB, DDRB;
+extern volatile uint8_t PORTC, DDRC;
+extern volatile uint8_t PORTD, DDRD;
+#define PINB mh_hostPinB()
+#define PINC mh_hostPinC()
+#define PIND mh_hostPinD()
+uint8_t mh_hostPinB();
+uint8_t mh_hostPinC();
+uint8_t mh_hostPinD();
+
+#define DDB1 1
+#define DDB2 2
+#define DDB3 3
+#define DDB5 5
+#define PORTB1 1
+#define PORTB3 3
+#define PORTB5 5
+
+//General purpose I/O registers, used for benchmark markers.
+extern volatile uint8_t GPIOR0, GPIOR1, GPIOR2;
+
+//Timer 2
+extern volatile uint8_t TCCR2A, TCCR2B, TCNT2, TIMSK2, OCR2A;
+#define WGM21 1
+#define CS22 2
+#define OCIE2A 1
+
+//SPI. The transfer is immediate, SPIF is always set.
+extern volatile uint8_t SPCR, SPSR, SPDR;
+#define SPE 6
+#define MSTR 4
+#define SPI2X 0
+#define SPIF 7
+
+//TWI, with the status codes of util/twi.h.
+extern volatile uint8_t TWAR, TWCR, TWSR, TWDR;
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWEN 2
+#define TWIE 0
+#define TWGCE 0
+
+#define TW_STATUS (TWSR & 0xF8)
+#define TW_BUS_ERROR 0x00
+#define TW_SR_SLA_ACK 0x60
+#define TW_SR_ARB_LOST_SLA_ACK 0x68
+#define TW_SR_GCALL_ACK 0x70
+#define TW_SR_ARB_LOST_GCALL_ACK 0x78
+#define TW_SR_DATA_ACK 0x80
+#define TW_SR_DATA_NACK 0x88
+#define TW_SR_GCALL_DATA_ACK 0x90
+#define TW_SR_GCALL_DATA_NACK 0x98
+#define TW_SR_STOP 0xA0
+#define TW_ST_SLA_ACK 0xA8
+#define TW_ST_ARB_LOST_SLA_ACK 0xB0
+#define TW_ST_DATA_ACK 0xB8
+#define TW_ST_DATA_NACK 0xC0
+#define TW_ST_LAST_DATA 0xC8
+
+//Sleep. The host doesn't sleep: time only goes on with mh_hostAdvance().
+#define SLEEP_MODE_IDLE 0
+inline void set_sleep_mode(uint8_t mode){ (void)mode; }
+inline void sleep_enable(){}
+inline void sleep_disable(){}
+inline void sleep_cpu(){}
+
+//Timing, from the emulated time.
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+//Virtual hardware.
+//Time for a TWI byte at 100kHz, 9 bits, in us. The TWI master lets the time go on by that much for each byte.
+const uint16_t MH_HOST_TWI_BYTE_TIME = 90;
+
+void mh_hostReset();
+void mh_hostAdvance(uint32_t us);
+
+void mh_hostSetKeys(uint16_t keys);
+void mh_hostSetJumpers(uint8_t jumpers);
+
+bool mh_hostTwiWrite(uint8_t address, const uint8_t *data, uint8_t length);
+bool mh_hostTwiRead(uint8_t address, uint8_t *data, uint8_t length);
+
+void mh_hostLedByte(uint8_t data);
+void mh_hostLedEnd();
+const uint8_t *mh_hostGetFrame();
+uint32_t mh_hostGetFrameCount();
+
+#endif
@@ -19,6 +19,8 @@
  */
 
 #include "moka_leds.h"
+#include "moka_stats.h"
+#include "moka_bench.h"
 
 
 // leds are numbered from 0 to 15, from left to right and from top to bottom
@@ -35,46 +37,143 @@
 //The top number when bit shifting. This is 16 leds * 3 colors * 8 bits
 
 
-const uint16_t NUM_LED = 16;
-
-//The table storing the current led color.
+//The front frame, sent to the leds and only written from the loop.
+//The TWI driver writes the stage frame. Latching it swaps it with the latched frame, from the TWI interrupt,
+//so bytes of the next frame never go to a latched one. The loop then copies the latched leds to the front frame.
 uint8_t _ml_ledColor[NUM_LED][3];
-uint8_t _ml_ledData[NUM_LED][3];
+uint8_t _ml_frame[2][NUM_LED][3];
+uint8_t (*_ml_ledStage)[3] = _ml_frame[0];
+uint8_t (*_ml_ledLatch)[3] = _ml_frame[1];
+// Gamma correction, applied to all the frames when they are sent, so colors are perceptually linear.
+// The table is computed at compile time: gamma is 2.2, i.e. 11 / 5, so the output o of a value v
+// is the smallest for which (o + 0.5)^5 >= v^11, both scaled to 1. It is found by bisection.
+constexpr double ml_pow(double x, uint8_t n){
+	return n ? x * ml_pow(x, n - 1) : 1.0;
+}
+
+constexpr bool ml_gammaAbove(uint8_t value, uint16_t output){
+	return ml_pow((output + 0.5) / 255.0, 5) >= ml_pow(value / 255.0, 11);
+}
+
+constexpr uint8_t ml_gammaSearch(uint8_t value, uint16_t low, uint16_t high){
+	return (low == high) ? low :
+		ml_gammaAbove(value, (low + high) / 2) ? ml_gammaSearch(value, low, (low + high) / 2) :
+		ml_gammaSearch(value, (low + high) / 2 + 1, high);
+}
+
+constexpr uint8_t ml_gamma(uint8_t value){
+	return ml_gammaSearch(value, 0, 255);
+}
+
+#define ML_GAMMA4(n) ml_gamma(n), ml_gamma(n + 1), ml_gamma(n + 2), ml_gamma(n + 3)
+#define ML_GAMMA16(n) ML_GAMMA4(n), ML_GAMMA4(n + 4), ML_GAMMA4(n + 8), ML_GAMMA4(n + 12)
+
+const uint8_t _ml_gammaTable[256] PROGMEM = {
+	ML_GAMMA16(0x00), ML_GAMMA16(0x10), ML_GAMMA16(0x20), ML_GAMMA16(0x30),
+	ML_GAMMA16(0x40), ML_GAMMA16(0x50), ML_GAMMA16(0x60), ML_GAMMA16(0x70),
+	ML_GAMMA16(0x80), ML_GAMMA16(0x90), ML_GAMMA16(0xA0), ML_GAMMA16(0xB0),
+	ML_GAMMA16(0xC0), ML_GAMMA16(0xD0), ML_GAMMA16(0xE0), ML_GAMMA16(0xF0),
+};
+
+//Steps of the 8 bits colors. They are taken before the gamma, so the leds show the same steps as
+//before the gamma was applied to all frames: 0, 9, 17, 26, 35, 46, 57, 70, 87, 109, 140, 184, 248.
 uint8_t _ml_ledBrightTable[13] = {
 	0,
-	9,
-	17,
-	26,
-	35,
-	46,
-	57,
-	70,
-	87,
-	109,
-	140,
-	183,
-	248	
+	56,
+	75,
+	91,
+	104,
+	117,
+	129,
+	142,
+	156,
+	173,
+	194,
+	220,
+	252
 };
 
+//Global brightness, applied before the gamma, so it dims the leds perceptually. 255 is full brightness.
+//Both are applied to each byte as it's sent, so the frame isn't copied.
+uint8_t _ml_brightness = 255;
+
+
+//The palette, 16 colors stored as GRB like the led table.
+//Leds colored from the palette keep their index, so they follow a palette change. Each frame has its own.
+uint8_t _ml_palette[ML_PALETTE_SIZE][3];
+uint8_t _ml_ledIndex[NUM_LED];
+uint8_t _ml_index[2][NUM_LED];
+uint8_t *_ml_stageIndex = _ml_index[0];
+uint8_t *_ml_latchIndex = _ml_index[1];
+ml_leds _ml_paletteLeds = 0;
+ml_leds _ml_stagePalette = 0;
+ml_leds _ml_latchPalette = 0;
+
+//Palette colors changed since the last latch, and the ones the front frame has to follow, one bit per color.
+//The front frame follows them once the next frame is latched, so palette changes never write it from the TWI interrupt.
+uint16_t _ml_paletteChanged = 0;
+volatile uint16_t _ml_paletteLatched = 0;
+
+//Leds written in the stage frame since the last latch, and leds of the latched frame not copied yet, one bit per led.
+//Other leds of these frames are outdated: a led is copied to the stage frame when first written.
+ml_leds _ml_staged = 0;
+volatile ml_leds _ml_latched = 0;
+
+//Color given to all the leds of a frame at once by ml_stageFill(), GRB, with its palette index.
+//Filled leds take it when they are written again, or copied to the front frame, so the TWI interrupt doesn't write each led.
+//The stage and latched frames each have one, swapped with them.
+struct ml_fill {
+	uint8_t color[3];
+	uint8_t index;
+	bool palette;
+	ml_leds leds;
+};
+
+ml_fill _ml_fill[2];
+ml_fill *_ml_stageFill = &_ml_fill[0];
+ml_fill *_ml_latchFill = &_ml_fill[1];
+
 //Led state, i.e. on or off: one bit per led
-uint16_t _ml_ledState = 0;
+ml_leds _ml_ledState = 0;
 
 //The display state, i.e. if leds are lit or shut, independently of their respective values
 bool _ml_displayOn = false;
 
-//The blink state, i.e. if the display blinks
+//The blink state, i.e. if the display blinks, and the current blink phase: true when leds are shut.
 bool _ml_displayBlink = false;
 bool _ml_currentBlink = false;
 
 uint16_t _ml_blinkOnDelay = 1000;
 uint16_t _ml_blinkOffDelay = 1000;
 
+//Leds that blink, one bit per led. Default is the whole display.
+ml_leds _ml_blinkMask = ML_ALL_LEDS;
+//Time of the last blink phase change.
+uint32_t _ml_blinkTime = 0;
+
+//Dirty leds, i.e. which output changed since last refresh: one bit per led.
+//It's set from TWI interrupt too, so it's always changed with interrupts disabled.
+volatile ml_leds _ml_dirty = 0;
+
+//Number of frames sent to the leds, and of updates skipped because nothing changed.
+uint16_t _ml_refreshCount = 0;
+uint16_t _ml_skipCount = 0;
+
 //Init the timer for led driving
 void ml_init(){
+#if ML_OUTPUT == ML_OUTPUT_SPI
+    //Set SPI as master at F_CPU / 2, MSB first, mode 0. MOSI, SCK and SS are outputs, default to 0.
+    //SS has to be an output, else the SPI may turn slave.
+    DDRB |= _BV(DDB3) | _BV(DDB5) | _BV(DDB2);
+    PORTB &= ~(_BV(PORTB3) | _BV(PORTB5));
+    SPCR = _BV(SPE) | _BV(MSTR);
+    SPSR = _BV(SPI2X);
+#else
     //Set the led data pin, output, default to 0;
 
     DDRB |= _BV(DDB1);
     PORTB &= ~(_BV(PORTB1));
+#endif
 
     ml_clrLeds(); 
     ml_setDisplayState(true);
@@ -82,9 +181,15 @@ void ml_init(){
 }
 
 // Set led value with 8 bits-defined color
-// color is 0xAARRGGBB, and is converted into 3-bytes color value before to be stored in led table
-// 1 offset on the alpha channel is for having 4 steps of luminosity.
 void ml_setColor(uint8_t ledId, uint8_t color){
+	uint32_t rgb = ml_convertColor(color);
+	ml_setColor(ledId, (uint8_t)(rgb >> 16), (uint8_t)(rgb >> 8), (uint8_t)rgb);
+}
+
+// Convert a 8 bits-defined color to a 24 bits value.
+// color is 0xAARRGGBB, and is converted into 3-bytes color value 0xRRGGBB.
+// 1 offset on the alpha channel is for having 4 steps of luminosity.
+uint32_t ml_convertColor(uint8_t color){
 	uint8_t aChannel = ((color >> 6) & 0x03) + 1;
 	uint8_t rChannel = (color >> 4) & 0x03;
 	uint8_t gChannel = (color >> 2) & 0x03;
@@ -102,63 +207,538 @@ void ml_setColor(uint8_t ledId, uint8_t color){
 	gChannel = _ml_ledBrightTable[gChannel];
 	bChannel = _ml_ledBrightTable[bChannel];
 
-	ml_setColor(ledId, rChannel, gChannel, bChannel);
-
+	return (uint32_t)(((uint32_t)rChannel << 16) | ((uint32_t)gChannel << 8) | ((uint32_t)bChannel));
 }
 
-//Set led value with 8 bits value for R, G and B channels.
+//Set led value with 8 bits value for R, G and B channels, in the front frame.
 void ml_setColor(uint8_t ledId, uint8_t rChannel, uint8_t gChannel, uint8_t bChannel){
+	uint8_t sreg = SREG;
+	cli();
+
+	ml_clrColorIndex(ledId);
+
 	_ml_ledColor[ledId][0] = gChannel;
 	_ml_ledColor[ledId][1] = rChannel;
 	_ml_ledColor[ledId][2] = bChannel;
+
+	_ml_dirty |= ML_LED(ledId);
+
+	SREG = sreg;
 }
 
-//Get led value on 24 bits
-uint32_t ml_getColor(uint8_t ledId){
-	uint8_t rChannel = _ml_ledColor[ledId][1];
-	uint8_t gChannel = _ml_ledColor[ledId][0];
-	uint8_t bChannel = _ml_ledColor[ledId][2];
-	return (uint32_t)(((uint32_t)rChannel << 16) | ((uint32_t)gChannel << 8) | ((uint32_t)bChannel));	
+//Set led value with a palette color. The led will follow the changes of this palette color.
+void ml_setColorIndex(uint8_t ledId, uint8_t index){
+	index &= (ML_PALETTE_SIZE - 1);
+
+	uint8_t sreg = SREG;
+	cli();
+
+	_ml_ledIndex[ledId] = index;
+	_ml_paletteLeds |= ML_LED(ledId);
+
+	memcpy(_ml_ledColor[ledId], _ml_palette[index], 3);
+
+	_ml_dirty |= ML_LED(ledId);
+
+	SREG = sreg;
 }
 
-//Update the 16 leds.
-void ml_update(){
-	// If display is on, then copy values from ledColor to ledData
-	if(_ml_displayOn){
-		// For each led, copy value if led is lit, else fill color bytes with zeros
-		for(uint8_t i = 0; i < NUM_LED; i++){
-			if(_ml_ledState & _BV(i)){
-				memcpy(_ml_ledData[i], _ml_ledColor[i], 3);
+//The led color is no longer set from the palette.
+void ml_clrColorIndex(uint8_t ledId){
+	_ml_paletteLeds &= ~ML_LED(ledId);
+}
+
+//Get the color of a led as it will be shown once the frames are latched, from the latched frame if it's there, else from
+//the front one. A palette led takes the current palette color. Index and palette flag are returned too.
+const uint8_t *ml_getNext(uint8_t ledId, uint8_t *index, bool *palette){
+	ml_leds mask = ML_LED(ledId);
+	const uint8_t *color = _ml_ledColor[ledId];
+	*index = _ml_ledIndex[ledId];
+	*palette = _ml_paletteLeds & mask;
+
+	if(_ml_latchFill->leds & mask){
+		color = _ml_latchFill->color;
+		*index = _ml_latchFill->index;
+		*palette = _ml_latchFill->palette;
+	} else if(_ml_latched & mask){
+		color = _ml_ledLatch[ledId];
+		*index = _ml_latchIndex[ledId];
+		*palette = _ml_latchPalette & mask;
+	}
+
+	if(*palette){
+		color = _ml_palette[*index];
+	}
+	return color;
+}
+
+//Write a led of the stage frame. Interrupts have to be disabled.
+void ml_writeStage(uint8_t ledId, const uint8_t *color, uint8_t index, bool palette){
+	memcpy(_ml_ledStage[ledId], color, 3);
+	_ml_stageIndex[ledId] = index;
+	if(palette){
+		_ml_stagePalette |= ML_LED(ledId);
+	} else {
+		_ml_stagePalette &= ~ML_LED(ledId);
+	}
+}
+
+//Stage a led, so it can be written in the stage frame. It's called from the TWI interrupt too.
+//The first time since the last latch, the led is copied to the stage frame, so a write of some channels keeps the others.
+//It's called before each write, so a write is always to the stage frame, even if it was swapped meanwhile.
+void ml_stageLed(uint8_t ledId){
+	ml_leds mask = ML_LED(ledId);
+
+	uint8_t sreg = SREG;
+	cli();
+	if(_ml_stageFill->leds & mask){
+		ml_writeStage(ledId, _ml_stageFill->color, _ml_stageFill->index, _ml_stageFill->palette);
+		_ml_stageFill->leds &= ~mask;
+	} else if(!(_ml_staged & mask)){
+		uint8_t index;
+		bool palette;
+		const uint8_t *color = ml_getNext(ledId, &index, &palette);
+		ml_writeStage(ledId, color, index, palette);
+		_ml_staged |= mask;
+	}
+	_ml_stagePalette &= ~mask;
+	SREG = sreg;
+}
+
+//Stage led value with 8 bits-defined color
+void ml_stageColor(uint8_t ledId, uint8_t color){
+	uint32_t rgb = ml_convertColor(color);
+	ml_stageColor(ledId, (uint8_t)(rgb >> 16), (uint8_t)(rgb >> 8), (uint8_t)rgb);
+}
+
+//Stage led value with 8 bits value for R, G and B channels.
+void ml_stageColor(uint8_t ledId, uint8_t rChannel, uint8_t gChannel, uint8_t bChannel){
+	uint8_t sreg = SREG;
+	cli();
+	ml_stageLed(ledId);
+	_ml_ledStage[ledId][0] = gChannel;
+	_ml_ledStage[ledId][1] = rChannel;
+	_ml_ledStage[ledId][2] = bChannel;
+	SREG = sreg;
+}
+
+//Stage led value with a palette color. The led will follow the changes of this palette color once latched.
+void ml_stageColorIndex(uint8_t ledId, uint8_t index){
+	index &= (ML_PALETTE_SIZE - 1);
+
+	uint8_t sreg = SREG;
+	cli();
+	ml_stageLed(ledId);
+	_ml_stageIndex[ledId] = index;
+	_ml_stagePalette |= ML_LED(ledId);
+	memcpy(_ml_ledStage[ledId], _ml_palette[index], 3);
+	SREG = sreg;
+}
+
+//Stage all the leds with the same color. Only the color is kept, each led takes it when written again or shown.
+void ml_stageFill(uint8_t rChannel, uint8_t gChannel, uint8_t bChannel){
+	uint8_t sreg = SREG;
+	cli();
+	_ml_stageFill->color[0] = gChannel;
+	_ml_stageFill->color[1] = rChannel;
+	_ml_stageFill->color[2] = bChannel;
+	_ml_stageFill->palette = false;
+	_ml_stageFill->leds = ML_ALL_LEDS;
+	_ml_staged = ML_ALL_LEDS;
+	SREG = sreg;
+}
+
+//Stage all the leds with the same palette color, as ml_stageFill().
+void ml_stageFillIndex(uint8_t index){
+	index &= (ML_PALETTE_SIZE - 1);
+
+	uint8_t sreg = SREG;
+	cli();
+	memcpy(_ml_stageFill->color, _ml_palette[index], 3);
+	_ml_stageFill->index = index;
+	_ml_stageFill->palette = true;
+	_ml_stageFill->leds = ML_ALL_LEDS;
+	_ml_staged = ML_ALL_LEDS;
+	SREG = sreg;
+}
+
+//Save which leds are staged. It's called from the TWI interrupt when a command starts, with ml_dropStage().
+void ml_markStage(ml_stageMark *mark){
+	mark->staged = _ml_staged;
+	mark->fill = _ml_stageFill->leds;
+}
+
+//Drop the leds staged since the mark, so an incomplete command doesn't reach the next latch.
+//Leds staged since then are taken again from the next frame when written, and filled leds take the fill again.
+//Leds already staged before the mark keep the bytes they received.
+void ml_dropStage(const ml_stageMark *mark){
+	uint8_t sreg = SREG;
+	cli();
+	_ml_staged = mark->staged;
+	_ml_stageFill->leds = mark->fill;
+	SREG = sreg;
+}
+
+//Latch the stage frame. It's called from the TWI interrupt, when an output request is complete.
+//The stage and latched frames are swapped, which is a pointer exchange, and the loop copies the staged leds
+//to the front frame on next update. If the loop didn't copy the previous latched frame yet, the staged leds are
+//merged into it instead, which only happens when two frames are latched within a loop pass.
+//Palette leds of the front frame take the palette colors changed before the latch, from the loop too.
+void ml_latch(){
+	uint8_t sreg = SREG;
+	cli();
+
+	if(_ml_latched == 0){
+		uint8_t (*frame)[3] = _ml_ledLatch;
+		_ml_ledLatch = _ml_ledStage;
+		_ml_ledStage = frame;
+
+		uint8_t *index = _ml_latchIndex;
+		_ml_latchIndex = _ml_stageIndex;
+		_ml_stageIndex = index;
+
+		_ml_latchPalette = _ml_stagePalette;
+
+		ml_fill *fill = _ml_latchFill;
+		_ml_latchFill = _ml_stageFill;
+		_ml_stageFill = fill;
+		_ml_stageFill->leds = 0;
+
+		_ml_latched = _ml_staged;
+	} else {
+		ml_leds mask = 1;
+		for(uint8_t i = 0; i < NUM_LED; i++, mask <<= 1){
+			if(!(_ml_staged & mask)){
+				continue;
+			}
+			const uint8_t *color = _ml_ledStage[i];
+			uint8_t index = _ml_stageIndex[i];
+			bool palette = _ml_stagePalette & mask;
+			if(_ml_stageFill->leds & mask){
+				color = _ml_stageFill->color;
+				index = _ml_stageFill->index;
+				palette = _ml_stageFill->palette;
+			}
+
+			memcpy(_ml_ledLatch[i], color, 3);
+			_ml_latchIndex[i] = index;
+			if(palette){
+				_ml_latchPalette |= mask;
 			} else {
-				memset(_ml_ledData[i], 0, 3);
+				_ml_latchPalette &= ~mask;
+			}
+			_ml_latchFill->leds &= ~mask;
+		}
+		_ml_stageFill->leds = 0;
+		_ml_latched |= _ml_staged;
+	}
+
+	_ml_staged = 0;
+	_ml_paletteLatched |= _ml_paletteChanged;
+	_ml_paletteChanged = 0;
+
+	SREG = sreg;
+}
+
+//Copy the latched frame to the front frame. To be called from the loop, before sending.
+//Leds are copied one at a time, again if a frame is latched meanwhile, and marked as changed.
+//Last, palette leds of the front frame take the palette colors changed before the latch.
+void ml_commit(){
+	uint8_t sreg = SREG;
+
+	while(_ml_latched != 0){
+		ml_leds mask = 1;
+		for(uint8_t i = 0; i < NUM_LED; i++, mask <<= 1){
+			cli();
+			if(_ml_latched & mask){
+				uint8_t index;
+				bool palette;
+				memcpy(_ml_ledColor[i], ml_getNext(i, &index, &palette), 3);
+				_ml_ledIndex[i] = index;
+				if(palette){
+					_ml_paletteLeds |= mask;
+				} else {
+					_ml_paletteLeds &= ~mask;
+				}
+				_ml_latchFill->leds &= ~mask;
+				_ml_latched &= ~mask;
+				_ml_dirty |= mask;
 			}
+			SREG = sreg;
 		}
-	// If display is off, then just fill led Data with zeros.
+	}
+
+	cli();
+	uint16_t changed = _ml_paletteLatched;
+	_ml_paletteLatched = 0;
+	SREG = sreg;
+
+	if(!changed){
+		return;
+	}
+
+	ml_leds mask = 1;
+	for(uint8_t i = 0; i < NUM_LED; i++, mask <<= 1){
+		cli();
+		if((_ml_paletteLeds & mask) && (changed & _BV(_ml_ledIndex[i]))){
+			ml_setColorIndex(i, _ml_ledIndex[i]);
+		}
+		SREG = sreg;
+	}
+}
+
+//Set a palette color. It's called from the TWI interrupt.
+//Leds staged with it are updated in the stage frame. The front frame follows once the next frame is latched.
+//Other leds take it when they are staged.
+void ml_setPalette(uint8_t index, uint8_t rChannel, uint8_t gChannel, uint8_t bChannel){
+	index &= (ML_PALETTE_SIZE - 1);
+
+	uint8_t sreg = SREG;
+	cli();
+
+	_ml_palette[index][0] = gChannel;
+	_ml_palette[index][1] = rChannel;
+	_ml_palette[index][2] = bChannel;
+	_ml_paletteChanged |= _BV(index);
+
+	if(_ml_stageFill->palette && (_ml_stageFill->index == index)){
+		memcpy(_ml_stageFill->color, _ml_palette[index], 3);
+	}
+
+	ml_leds staged = _ml_staged & _ml_stagePalette;
+	ml_leds mask = 1;
+	for(uint8_t i = 0; i < NUM_LED; i++, mask <<= 1){
+		if((staged & mask) && (_ml_stageIndex[i] == index)){
+			memcpy(_ml_ledStage[i], _ml_palette[index], 3);
+		}
+	}
+
+	SREG = sreg;
+}
+
+//Get a palette color on 24 bits
+uint32_t ml_getPalette(uint8_t index){
+	index &= (ML_PALETTE_SIZE - 1);
+	uint8_t rChannel = _ml_palette[index][1];
+	uint8_t gChannel = _ml_palette[index][0];
+	uint8_t bChannel = _ml_palette[index][2];
+	return (uint32_t)(((uint32_t)rChannel << 16) | ((uint32_t)gChannel << 8) | ((uint32_t)bChannel));
+}
+
+//Get led value on 24 bits, from the front frame or the stage one.
+//A led not staged reads as it will be staged, from the latched frame or the front one.
+uint32_t ml_getColor(uint8_t ledId, uint8_t frame){
+	const uint8_t *color = _ml_ledColor[ledId];
+
+	uint8_t sreg = SREG;
+	cli();
+	if(frame == ML_BACK){
+		if(_ml_stageFill->leds & ML_LED(ledId)){
+			color = _ml_stageFill->color;
+		} else if(_ml_staged & ML_LED(ledId)){
+			color = _ml_ledStage[ledId];
+		} else {
+			uint8_t index;
+			bool palette;
+			color = ml_getNext(ledId, &index, &palette);
+		}
+	}
+
+	uint8_t rChannel = color[1];
+	uint8_t gChannel = color[0];
+	uint8_t bChannel = color[2];
+	SREG = sreg;
+	return (uint32_t)(((uint32_t)rChannel << 16) | ((uint32_t)gChannel << 8) | ((uint32_t)bChannel));	
+}
+
+//Update the leds, if something changed since last refresh.
+void ml_update(){
+	MB_BEGIN(MB_LED_UPDATE);
+
+	ml_commit();
+	if(_ml_dirty == 0){
+		// Read from the TWI interrupt, so it's never seen half written.
+		uint8_t sreg = SREG;
+		cli();
+		_ml_skipCount++;
+		SREG = sreg;
 	} else {
-		// ledData is filled with 0
-		memset(_ml_ledData, 0, sizeof(_ml_ledData));
+		ml_refresh();
+	}
+
+	MB_END(MB_LED_UPDATE);
+}
+
+//Send the whole frame to the leds, whether something changed or not.
+void ml_refresh(){
+	ml_commit();
+
+	// Leds changed from now on will be sent on next update.
+	// The refresh count is read from the TWI interrupt, so it's updated with interrupts masked too.
+	uint8_t sreg = SREG;
+	cli();
+	_ml_dirty = 0;
+	_ml_refreshCount++;
+	SREG = sreg;
+
+	ms_refresh();
+
+	// Leds that are lit. Others are sent as zeros while streaming, without touching their color.
+	ml_leds ledOn = _ml_displayOn ? _ml_ledState : 0;
+
+	// Blinking leds are shut during the off phase.
+	if(_ml_displayBlink && _ml_currentBlink){
+		ledOn &= ~_ml_blinkMask;
+	}
+
+	ml_send(ledOn);
+}
+
+#if !defined(__AVR__) || ML_OUTPUT == ML_OUTPUT_SPI
+
+// Brightness then gamma of a byte as sent to the leds. The bit banged output does the same in asm.
+inline uint8_t ml_correctByte(uint8_t value){
+	value = ((uint16_t)value * ((uint16_t)_ml_brightness + 1)) >> 8;
+	return pgm_read_byte(&_ml_gammaTable[value]);
+}
+
+#endif
+
+#ifndef __AVR__
+
+// Host build: the frame goes to the host emulation, as the bytes on the wire, leds that are off being sent as zeros.
+void ml_send(ml_leds ledOn){
+	uint8_t *ptr = &_ml_ledColor[0][0];
+
+	for(uint8_t i = 0; i < NUM_LED; i++){
+		uint8_t mask = (ledOn & 0x01) ? 0xFF : 0;
+		ledOn >>= 1;
+
+		for(uint8_t j = 0; j < 3; j++){
+			mh_hostLedByte(ml_correctByte(*ptr++ & mask));
+		}
+	}
+
+	mh_hostLedEnd();
+}
+
+#elif ML_OUTPUT == ML_OUTPUT_SPI
+
+// SPI codes for two data bits. Each data bit is 4 SPI bits, i.e. 1us at 4MHz:
+// 0 is 1000, high for 250ns, and 1 is 1100, high for 500ns.
+// All codes end low, so the line stays low when the next byte is late.
+const uint8_t _ml_spiCode[4] = {0x88, 0x8C, 0xC8, 0xCC};
+
+// Send the frame through SPI, leds that are off being sent as zeros.
+// Interrupts are left enabled: an interrupt delaying the next SPI byte only makes the low time longer,
+// which the leds accept as long as it stays well below the 80us reset time.
+void ml_send(ml_leds ledOn){
+	uint8_t *ptr = &_ml_ledColor[0][0];
+
+	// Start with an empty byte, so SPIF is set for the first code. It keeps the line low for 2us.
+	SPDR = 0;
+
+	for(uint8_t i = 0; i < NUM_LED; i++){
+		uint8_t mask = (ledOn & 0x01) ? 0xFF : 0;
+		ledOn >>= 1;
+
+		for(uint8_t j = 0; j < 3; j++){
+			uint8_t curByte = ml_correctByte(*ptr++ & mask);
+
+			for(uint8_t k = 0; k < 4; k++){
+				uint8_t code = _ml_spiCode[curByte >> 6];
+				curByte <<= 2;
+				while(!(SPSR & _BV(SPIF)));
+				SPDR = code;
+			}
+		}
 	}
 
-	// Pointer to ledData, and first byte of data to be sent to leds.
-	uint8_t *ptr = &_ml_ledData[0][0];
-	uint8_t curByte = *ptr;
+	// Wait for the last byte to be out.
+	while(!(SPSR & _BV(SPIF)));
+}
+
+#else
+
+// Bit bang the frame on PB1, leds that are off being sent as zeros.
+// Interrupts are disabled during the whole frame.
+// Brightness and gamma are applied to each byte between the bytes, while the line is low.
+void ml_send(ml_leds ledOn){
+	// Pointer to the front frame, and byte of data being sent to leds.
+	uint8_t *ptr = &_ml_ledColor[0][0];
+	uint8_t curByte = 0;
+
+	// Gamma table, indexed by adding the value to it, and brightness.
+	const uint8_t *gamma = _ml_gammaTable;
+	uint8_t brightness = _ml_brightness;
 
 	// Value for turning deicated port pin high or low.
 	uint8_t hi = PORTB | _BV(PORTB1);
 	uint8_t lo = PORTB & ~_BV(PORTB1);
 
-	// Counters for total byte number, and for each bit in these bytes.
+	// Counters for leds, for bytes of each led, and for each bit in these bytes.
 	uint8_t counter = 0;
 	uint8_t nbByte = 0;
+	uint8_t nbLed = 0;
+
+	// Mask applied to the bytes of the current led: 0xFF if it's lit, 0 else.
+	uint8_t mask = 0;
+
+#if ML_NUM_LED > 32
+	// 64 bits led states don't fit an asm operand, they are shifted as two halves.
+	uint32_t ledOnLow = (uint32_t)ledOn;
+	uint32_t ledOnHigh = (uint32_t)(ledOn >> 32);
+#endif
 
 	// Save current state register before to disable ISR.
+	ms_maskStart();
 	uint8_t sreg = SREG;
 	cli();
-
+	MB_BEGIN(MB_LED_MASKED);
+
+	// Bit timing, counted from the instructions below and checked by the wave_* bench paths:
+	// 8 cycles a bit, high for 2 or 4 cycles, the same as when data was copied first.
+	// Only the low time of the last bit of a byte is longer, by instruction count: 17 cycles more within a led,
+	// 25 cycles more between leds. This is 3.1us at 8MHz, far from the 80us reset time. The bench measures it
+	// as wave_low, and the whole frame as led_masked.
+	// Led states wider than 16 bits take 2 cycles more between leds for 32 leds, 6 for 64.
+	// The bit counter is 0 between bytes, it's used as the zero register there, as mul writes r1.
 	asm volatile(
-		"ldi 	%[nbByte], 48			\n\t" // 1		Init bytes counter
+		"ldi 	%[nbLed], %[numLed]		\n\t" // 1		Init leds counter
+		"led%=:							\n\t" // /		Label led (new led)
+		"clr 	%[mask]					\n\t" // 1		Led is off by default
+		"sbrc	%A[ledOn], 0			\n\t" // 1/2	Skip if led is off
+		"com 	%[mask]					\n\t" // 1		Led is on, send its bytes as they are
+#if ML_NUM_LED <= 16
+		"lsr	%B[ledOn]				\n\t" // 1		Shift led states for next led
+		"ror	%A[ledOn]				\n\t" // 1
+#elif ML_NUM_LED <= 32
+		"lsr	%D[ledOn]				\n\t" // 1		Shift led states for next led
+		"ror	%C[ledOn]				\n\t" // 1
+		"ror	%B[ledOn]				\n\t" // 1
+		"ror	%A[ledOn]				\n\t" // 1
+#else
+		"lsr	%D[ledOnHigh]			\n\t" // 1		Shift led states for next led, high half first
+		"ror	%C[ledOnHigh]			\n\t" // 1
+		"ror	%B[ledOnHigh]			\n\t" // 1
+		"ror	%A[ledOnHigh]			\n\t" // 1
+		"ror	%D[ledOn]				\n\t" // 1
+		"ror	%C[ledOn]				\n\t" // 1
+		"ror	%B[ledOn]				\n\t" // 1
+		"ror	%A[ledOn]				\n\t" // 1
+#endif
+		"ldi 	%[nbByte], 3			\n\t" // 1		Init bytes counter
 		"head%=:						\n\t" // /		Label head (new byte)
 		"ld 	%[curByte], %a[ptr]+	\n\t" // 2		Load the next value
+		"and	%[curByte], %[mask]		\n\t" // 1		Clear it if led is off
+		"mul	%[curByte], %[bright]	\n\t" // 2		Scale by brightness + 1: value * brightness
+		"add	r0, %[curByte]			\n\t" // 1		+ value, high byte kept
+		"adc	r1, %[counter]			\n\t" // 1
+		"add	%A[gamma], r1			\n\t" // 1		Point the gamma table entry
+		"adc	%B[gamma], %[counter]	\n\t" // 1
+		"lpm	%[curByte], Z			\n\t" // 3		Load the corrected value
+		"sub	%A[gamma], r1			\n\t" // 1		Back to the table start
+		"sbc	%B[gamma], %[counter]	\n\t" // 1
 		"ldi 	%[counter], 8			\n\t" // 1		init bit counter
 		"bit%=:							\n\t" // /		Label bit (next bit)
 		"out 	%[port], %[hi]			\n\t" // 1		Set port pin high
@@ -170,42 +750,86 @@ void ml_update(){
 		"brne	bit%=					\n\t" // 1/2	branch label bit if counter is 0
 		"dec 	%[nbByte]				\n\t" // 1		Decrement byte counter
 		"brne 	head%=					\n\t" // 1/2	branch label head if counter is 0
+		"dec 	%[nbLed]				\n\t" // 1		Decrement led counter
+		"brne 	led%=					\n\t" // 1/2	branch label led if counter is 0
+		"clr	__zero_reg__			\n\t" // 1		Restore the zero register
 
 		:	[counter]	"+d"	(counter),
 			[nbByte]	"+d"	(nbByte),
-			[curByte]	"+r"	(curByte)
-		:	[lo]		"r"		(lo),
+			[nbLed]		"+d"	(nbLed),
+			[curByte]	"+r"	(curByte),
+			[mask]		"+r"	(mask),
+#if ML_NUM_LED <= 32
+			[ledOn]		"+r"	(ledOn),
+#else
+			[ledOn]		"+r"	(ledOnLow),
+			[ledOnHigh]	"+r"	(ledOnHigh),
+#endif
+			[ptr]		"+e"	(ptr),
+			[gamma]		"+z"	(gamma)
+		:	[bright]	"r"		(brightness),
+			[lo]		"r"		(lo),
 			[hi]		"r"		(hi),
 			[port]		"I"		(_SFR_IO_ADDR(PORTB)),
-			[ptr]		"e"		(ptr)
+			[numLed]	"M"		(NUM_LED)
+		:	"r0"
 	);
 
 	// Enable ISR again.
+	MB_END(MB_LED_MASKED);
 	SREG = sreg;
+	ms_maskEnd();
 }
 
-// Set led states for a 16 bit int, each bit beeing a led
-void ml_setLed(uint16_t state){
+#endif
+
+// Set led states, each bit beeing a led
+void ml_setLed(ml_leds state){
+	ml_setDirty(_ml_ledState ^ state);
 	_ml_ledState = state;
 }
 
 // Set led state for one led
 void ml_setLed(uint8_t ledId, bool state){
+	ml_leds ledState = _ml_ledState;
 	if(state){
-		_ml_ledState |= _BV(ledId);
+		ledState |= ML_LED(ledId);
 	} else {
-		_ml_ledState &= ~_BV(ledId);
+		ledState &= ~ML_LED(ledId);
 	}
+	ml_setLed(ledState);
 }
 
 // Set the diplay state (turned on or off)
 void ml_setDisplayState(bool state){
+	if(state != _ml_displayOn){
+		ml_setDirty(ML_ALL_LEDS);
+	}
 	_ml_displayOn = state;
 }
 
 // Set the blink state (turned on or off)
+// Blinking always starts with the on phase.
 void ml_setBlinkState(bool state){
+	if(state == _ml_displayBlink){
+		return;
+	}
+
+	if(_ml_currentBlink){
+		ml_setDirty(_ml_blinkMask);
+	}
+
 	_ml_displayBlink = state;
+	_ml_currentBlink = false;
+	_ml_blinkTime = millis();
+}
+
+// Set which leds blink, one bit per led.
+void ml_setBlinkMask(ml_leds mask){
+	if(_ml_displayBlink && _ml_currentBlink){
+		ml_setDirty(_ml_blinkMask ^ mask);
+	}
+	_ml_blinkMask = mask;
 }
 
 //Set the duration of the on state when blinking
@@ -218,13 +842,91 @@ void ml_setBlinkOffDelay(uint16_t delay){
 	_ml_blinkOffDelay = delay;
 }
 
+//Set the global brightness. All the leds are sent again with it on next update.
+void ml_setBrightness(uint8_t brightness){
+	if(brightness != _ml_brightness){
+		_ml_brightness = brightness;
+		ml_setDirty(ML_ALL_LEDS);
+	}
+}
+
+// Blink the display. To be called from the loop.
+// When a blink phase is over, the other one begins and the blinking leds are marked as changed,
+// so they are sent on next update.
 void ml_blink(){
+	if(!_ml_displayBlink){
+		return;
+	}
+
+	uint32_t now = millis();
+	uint16_t delay = _ml_currentBlink ? _ml_blinkOffDelay : _ml_blinkOnDelay;
+
+	if((now - _ml_blinkTime) < delay){
+		return;
+	}
+
+	_ml_blinkTime = now;
+	_ml_currentBlink = !_ml_currentBlink;
+
+	ml_setDirty(_ml_blinkMask);
+}
+
+//Get the led states, one bit per led.
+ml_leds ml_getLed(){
+	return _ml_ledState;
+}
+
+//Get the display state.
+bool ml_getDisplayState(){
+	return _ml_displayOn;
+}
+
+//Get the blink state.
+bool ml_getBlinkState(){
+	return _ml_displayBlink;
+}
+
+//Get the leds that blink, one bit per led.
+ml_leds ml_getBlinkMask(){
+	return _ml_blinkMask;
+}
+
+//Get the duration of the on state when blinking
+uint16_t ml_getBlinkOnDelay(){
+	return _ml_blinkOnDelay;
+}
+
+//Get the duration of the off state when blinking
+uint16_t ml_getBlinkOffDelay(){
+	return _ml_blinkOffDelay;
+}
+
+//Get the global brightness.
+uint8_t ml_getBrightness(){
+	return _ml_brightness;
+}
+
+//Mark leds as changed, so they are sent on next update.
+void ml_setDirty(ml_leds leds){
+	uint8_t sreg = SREG;
+	cli();
+	_ml_dirty |= leds;
+	SREG = sreg;
+}
+
+//Get the number of frames sent to the leds.
+uint16_t ml_getRefreshCount(){
+	return _ml_refreshCount;
+}
 
+//Get the number of updates skipped because no led changed.
+uint16_t ml_getSkipCount(){
+	return _ml_skipCount;
 }
 
 //Clear all leds (each channel of each led is set to 0)
 void ml_clrLeds(){
-	for(uint8_t i = 0; i < 16; i++){
+	for(uint8_t i = 0; i < NUM_LED; i++){
 		ml_setColor(i, 0, 0, 0);
 	}
 }
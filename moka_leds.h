@@ -21,29 +21,115 @@
 #ifndef MOKA_LEDS_H
 #define MOKA_LEDS_H
 
-#include <Arduino.h>
+#include "moka_hal.h"
+
+//Led output, chosen at compile time.
+//ML_OUTPUT_BITBANG: led data on PB1, bit banged with interrupts disabled during the frame (~400us).
+//ML_OUTPUT_SPI: led data on MOSI (PB3), encoded by the SPI, interrupts stay enabled. Led data has to be wired to PB3.
+#define ML_OUTPUT_BITBANG	0
+#define ML_OUTPUT_SPI		1
+
+#ifndef ML_OUTPUT
+#define ML_OUTPUT ML_OUTPUT_BITBANG
+#endif
+
+//Number of leds, chained on the data line, chosen at compile time up to 64.
+//Led states and masks are one bit per led, in the smallest type that holds them all.
+#ifndef ML_NUM_LED
+#define ML_NUM_LED 16
+#endif
+
+#if ML_NUM_LED > 64
+#error "ML_NUM_LED is 64 at most: led states are one bit per led in 64 bits"
+#endif
+
+const uint16_t NUM_LED = ML_NUM_LED;
+
+#if ML_NUM_LED <= 16
+typedef uint16_t ml_leds;
+#elif ML_NUM_LED <= 32
+typedef uint32_t ml_leds;
+#else
+typedef uint64_t ml_leds;
+#endif
+
+//All the leds, and the bit of one led.
+const ml_leds ML_ALL_LEDS = (ml_leds)~(ml_leds)0 >> (8 * sizeof(ml_leds) - ML_NUM_LED);
+#define ML_LED(ledId) ((ml_leds)1 << (ledId))
+
+//Number of palette colors, must be a power of 2.
+const uint8_t ML_PALETTE_SIZE = 16;
 
 extern bool _ml_displayBlink;
 
+//Frames, for ml_getColor().
+const uint8_t ML_FRONT = 0;
+const uint8_t ML_BACK = 1;
+
+//The front frame, sent to the leds, and the stage frame written directly by the TWI driver when streaming frames.
+//The stage frame is swapped by ml_latch(), so it must be read through its pointer each time.
+extern uint8_t _ml_ledColor[NUM_LED][3];
+extern uint8_t (*_ml_ledStage)[3];
+
+//Leds staged, and leds still taking the stage fill, saved when a TWI command starts, so an incomplete one can be dropped.
+struct ml_stageMark{
+	ml_leds staged;
+	ml_leds fill;
+};
+
 void ml_init();
 void ml_setColor(uint8_t ledId, uint8_t color);
 void ml_setColor(uint8_t ledId, uint8_t rChannel, uint8_t gChannel, uint8_t bChannel);
+uint32_t ml_convertColor(uint8_t color);
 
-uint32_t ml_getColor(uint8_t ledId);
+void ml_stageLed(uint8_t ledId);
+void ml_stageColor(uint8_t ledId, uint8_t color);
+void ml_stageColor(uint8_t ledId, uint8_t rChannel, uint8_t gChannel, uint8_t bChannel);
+void ml_stageColorIndex(uint8_t ledId, uint8_t index);
+void ml_stageFill(uint8_t rChannel, uint8_t gChannel, uint8_t bChannel);
+void ml_stageFillIndex(uint8_t index);
+void ml_markStage(ml_stageMark *mark);
+void ml_dropStage(const ml_stageMark *mark);
+void ml_latch();
+void ml_commit();
 
-void ml_setLed(uint16_t state);
+void ml_setColorIndex(uint8_t ledId, uint8_t index);
+void ml_clrColorIndex(uint8_t ledId);
+void ml_setPalette(uint8_t index, uint8_t rChannel, uint8_t gChannel, uint8_t bChannel);
+uint32_t ml_getPalette(uint8_t index);
+
+uint32_t ml_getColor(uint8_t ledId, uint8_t frame = ML_FRONT);
+
+void ml_setLed(ml_leds state);
 void ml_setLed(uint8_t ledId, bool state);
 void ml_setDisplayState(bool state);
 void ml_setBlinkState(bool state);
+void ml_setBlinkMask(ml_leds mask);
 
 void ml_setBlinkOnDelay(uint16_t delay);
 void ml_setBlinkOffDelay(uint16_t delay);
+void ml_setBrightness(uint8_t brightness);
+
+ml_leds ml_getLed();
+bool ml_getDisplayState();
+bool ml_getBlinkState();
+ml_leds ml_getBlinkMask();
+uint16_t ml_getBlinkOnDelay();
+uint16_t ml_getBlinkOffDelay();
+uint8_t ml_getBrightness();
 
 void ml_blink();
 
 void ml_clrLeds();
 
+void ml_setDirty(ml_leds leds);
+
 void ml_update();
+void ml_refresh();
+void ml_send(ml_leds ledOn);
+
+uint16_t ml_getRefreshCount();
+uint16_t ml_getSkipCount();
 
 #endif
  
\ No newline at end of file
@@ -18,21 +18,56 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-// Button state are stored as a 16 bits value, each bit beeing a button state.
+// Button state are stored one bit per button, in a mp_keys value sized for the pad.
 
 #include "moka_pad.h"
 #include "moka_leds.h"
+#include "moka_stats.h"
+#include "moka_bench.h"
 
-uint16_t _mp_now;
-uint16_t _mp_prev;
-uint16_t _mp_state;
-uint16_t _mp_pState;
+mp_keys _mp_now;
+mp_keys _mp_state;
+mp_keys _mp_pState;
 
-//independent debounce
-uint32_t _mp_time[16];
+// Scan engine. Timer2 fires every settle time, each tick samples the row driven on the previous
+// tick and drives the next one. A full reading is published to mp_update() once all the rows are read.
+volatile mp_keys _mp_scan;
+volatile bool _mp_scanReady = false;
+mp_keys _mp_scanBuffer;
+uint8_t _mp_scanRow;
+uint8_t _mp_scanTick;
+uint8_t _mp_scanTicks;
+
+// Settle time and scan period in microseconds, used to turn the debounce delay into a number of scans.
+// The longest scan period is 255 ticks of 2048us, so it needs 32 bits.
+uint16_t _mp_settleTime;
+uint32_t _mp_scanPeriod;
+
+//parallel debounce
+// Each button has a 4 bits counter of the consecutive scans where its reading differs from its state.
+// Counters are stored vertically: _mp_countN holds the bit N of all the counters,
+// so all buttons are counted at once with a few word operations. Their cost is in the pad_update bench path.
+mp_keys _mp_count0;
+mp_keys _mp_count1;
+mp_keys _mp_count2;
+mp_keys _mp_count3;
+
+// Number of scans needed for a state change, stored the same way. Each word is all zeros or all ones.
+mp_keys _mp_limit0;
+mp_keys _mp_limit1;
+mp_keys _mp_limit2;
+mp_keys _mp_limit3;
 
 uint16_t _mp_debounceDelay;
 
+//Key events ring buffer. mp_update() is the only writer of the head, the reader the only one of the tail,
+//so the reader can be in interrupt context.
+mp_event _mp_event[MP_EVENT_SIZE];
+volatile uint8_t _mp_eventHead = 0;
+volatile uint8_t _mp_eventTail = 0;
+// Number of events lost because the buffer was full. Cleared when read.
+uint8_t _mp_eventOverflow = 0;
+
 //bool _mp_int = false;
 
 // Init all that is linked to buttons.
@@ -48,116 +83,267 @@ void mp_init(){
  * PD3: button row 4: output high / input.
  */
 
-	DDRC &= ~(0x0F);
-	PORTC |= 0x0F;
+	MP_COL_DDR &= ~MP_COL_MASK;
+	MP_COL_PORT |= MP_COL_MASK;
 
-	DDRD &= ~(0x0F);
-	PORTD &= ~(0x0F);
+	MP_ROW_DDR &= ~MP_ROW_MASK;
+	MP_ROW_PORT &= ~MP_ROW_MASK;
+
+	_mp_now = MP_ALL_KEYS;
+	_mp_state = MP_ALL_KEYS;
+	_mp_pState = MP_ALL_KEYS;
+
+	_mp_count0 = 0;
+	_mp_count1 = 0;
+	_mp_count2 = 0;
+	_mp_count3 = 0;
+
+	_mp_debounceDelay = 3;
 
-	_mp_prev = 0xFFFF;
-	_mp_now = 0xFFFF;
-	_mp_state = 0xFFFF;
-	_mp_pState = 0xFFFF;
+	// No row is driven until the first tick.
+	_mp_scanRow = MP_ROWS;
+	_mp_scanTicks = MP_SCAN_TICKS;
+	_mp_scanTick = _mp_scanTicks - 1;
 
-	uint32_t _mp_tTime = millis();
+	// Timer2 in CTC mode, prescaler 64, compare match A interrupt.
+	TCCR2A = _BV(WGM21);
+	TCCR2B = _BV(CS22);
+	TCNT2 = 0;
+	mp_setSettleTime(MP_SETTLE_TIME);
+	TIMSK2 = _BV(OCIE2A);
 
-	for(uint8_t i = 0; i < 16; ++i){
-		_mp_time[i] = _mp_tTime;
+}
+
+//Set the time a row is driven before it is read, in microseconds.
+//Timer2 counts at F_CPU / 64, so the resolution is 8us at 8MHz, and the longest settle time is 256 counts.
+void mp_setSettleTime(uint16_t settle){
+	uint32_t counts = ((uint32_t)settle * (F_CPU / 1000000UL)) / 64;
+	if(counts < 1){
+		counts = 1;
+	} else if(counts > 256){
+		counts = 256;
 	}
+	OCR2A = counts - 1;
 
-	_mp_debounceDelay = 3;
+	_mp_settleTime = (counts * 64) / (F_CPU / 1000000UL);
+	_mp_scanPeriod = (uint32_t)_mp_settleTime * _mp_scanTicks;
+	mp_computeDebounce();
+}
 
+//Set the number of ticks for a whole scan. The first ticks read rows, one each, the others are idle.
+//The scan period is then ticks * settle time.
+void mp_setScanTicks(uint8_t ticks){
+	if(ticks < MP_ROWS){
+		ticks = MP_ROWS;
+	}
+	uint8_t sreg = SREG;
+	cli();
+	_mp_scanTicks = ticks;
+	_mp_scanTick = 0;
+	SREG = sreg;
+
+	_mp_scanPeriod = (uint32_t)_mp_settleTime * ticks;
+	mp_computeDebounce();
 }
 
-//set a cutom debounce delay. Defaut is 5ms.
+//set a cutom debounce delay, in ms. Defaut is 3ms.
 void mp_setDebounceDelay(uint16_t debounce){
 	_mp_debounceDelay = debounce;
+	mp_computeDebounce();
+}
+
+//Get the debounce delay, in ms.
+uint16_t mp_getDebounceDelay(){
+	return _mp_debounceDelay;
+}
+
+//Compute the debounce limit from the debounce delay and the scan period.
+//A reading has to be steady for more than the delay, the limit is then one scan more than the delay.
+//It is capped by the counters width, i.e. 15 scans.
+void mp_computeDebounce(){
+	uint32_t scans = ((uint32_t)_mp_debounceDelay * 1000) / _mp_scanPeriod + 1;
+	if(scans > 15){
+		scans = 15;
+	}
+
+	_mp_limit0 = (scans & 0x01) ? MP_ALL_KEYS : 0;
+	_mp_limit1 = (scans & 0x02) ? MP_ALL_KEYS : 0;
+	_mp_limit2 = (scans & 0x04) ? MP_ALL_KEYS : 0;
+	_mp_limit3 = (scans & 0x08) ? MP_ALL_KEYS : 0;
 }
 
 //Get the value for a button
 //The returned value is true when pushed, i.e. pulled low.
 bool mp_getButton(uint8_t button){
-	return ~(_mp_state & _BV(button));
+	return ~(_mp_state & ((mp_keys)1 << button));
 }
 
 //Get the values for the whole grid
 //The returned value is true when pushed.
-uint16_t mp_getButtons(){
+mp_keys mp_getButtons(){
 //	_mp_int = false;
 	return ~_mp_state;
 }
 
+// Scan tick. Read the row driven since last tick, release it, and drive the next one.
+ISR(TIMER2_COMPA_vect){
+	MB_BEGIN(MB_PAD_SCAN);
+
+	if(_mp_scanRow < MP_ROWS){
+		_mp_scanBuffer |= ((mp_keys)(MP_COL_PIN & MP_COL_MASK) << (_mp_scanRow * MP_COLS));
+		MP_ROW_DDR &= ~MP_ROW_MASK;
+
+		// Last row read, the reading is complete.
+		if(_mp_scanRow == MP_ROWS - 1){
+			_mp_scan = _mp_scanBuffer;
+			_mp_scanReady = true;
+		}
+	}
+
+	if(++_mp_scanTick >= _mp_scanTicks){
+		_mp_scanTick = 0;
+		_mp_scanBuffer = 0;
+	}
+
+	// Buttons are active low, so the row to be read is turned output low.
+	// The row port is kept low, only its direction changes.
+	if(_mp_scanTick < MP_ROWS){
+		_mp_scanRow = _mp_scanTick;
+		MP_ROW_DDR |= _BV(_mp_scanRow);
+	} else {
+		_mp_scanRow = MP_ROWS;
+	}
+
+	MB_END(MB_PAD_SCAN);
+}
+
+// Tell if a reading has been completed since last update.
+bool mp_isScanReady(){
+	return _mp_scanReady;
+}
+
 //update the pad reading.
+//Returns immediately when no new reading has been completed by the scan tick since last call.
 bool mp_update(){
 
-	_mp_prev = _mp_now;
-	_mp_now = 0;
-	for(uint8_t row = 0; row < 4; row++){
-		// Turn port D as input.
-		DDRD &= ~(0x0F);
-		PORTD &= ~(0x0F);
-		//Buttons are active low, so the row to be read is turned output low.
-		DDRD |= _BV(row);
-		PORTD &= ~(_BV(row));
-		//Add a delay before reading?
-		delay(1);
-		uint8_t reading = 0;
-		reading = (PINC & 0x0F);
-		_mp_now |= ((reading) << (row * 4));
+	if(!_mp_scanReady){
+		return false;
 	}
 
-	// Turn port D as input
-	DDRD &= ~(0x0F);
-	PORTD &= ~(0x0F);
+	uint8_t sreg = SREG;
+	cli();
+	mp_keys reading = _mp_scan;
+	_mp_scanReady = false;
+	SREG = sreg;
+
+	ms_scan();
+
+	_mp_now = reading;
+
+	// Buttons which reading differs from their current state.
+	mp_keys delta = _mp_now ^ _mp_state;
 
-	// Store the current time, so the same is used for every button.
-	uint32_t _mp_tTime = millis();
-	bool change = false;
+	// Increment their counters, and clear the others. Counters are added a carry bit by bit.
+	mp_keys carry = delta;
+	mp_keys count;
 
-//	ml_setLed(~_mp_now);
+	count = _mp_count0;
+	_mp_count0 = (count ^ carry) & delta;
+	carry &= count;
 
-//	ml_setLed(0);
+	count = _mp_count1;
+	_mp_count1 = (count ^ carry) & delta;
+	carry &= count;
 
-	// Debounce each button.
-	for(uint8_t i = 0; i < 16; ++i){
-		// Bit of each button is kept for instant previous and present state,
-		// and for current active state.
-		bool prev = _mp_prev & _BV(i);
-		bool now = _mp_now & _BV(i);
-		bool state = _mp_state & _BV(i);
-		bool pState = _mp_pState & _BV(i);
+	count = _mp_count2;
+	_mp_count2 = (count ^ carry) & delta;
+	carry &= count;
 
-		// If there is a difference between instant previous read and current one,
-		// then init the counter. 
+	count = _mp_count3;
+	_mp_count3 = (count ^ carry) & delta;
 
-		if(prev != now){
-			_mp_time[i] = _mp_tTime;
-//			ml_setLed(i, true);
+	// Buttons which counter reached the limit change state, and their counter is reset.
+	mp_keys toggle = delta & ~((_mp_count0 ^ _mp_limit0) | (_mp_count1 ^ _mp_limit1) |
+			(_mp_count2 ^ _mp_limit2) | (_mp_count3 ^ _mp_limit3));
+
+	if(!toggle){
+		return false;
+	}
+
+	_mp_count0 &= ~toggle;
+	_mp_count1 &= ~toggle;
+	_mp_count2 &= ~toggle;
+	_mp_count3 &= ~toggle;
+
+	// Copy the previous state, then update the global value.
+	// We use a temp value to avoid problems with interrupts firing during reading.
+	_mp_pState = _mp_state;
+	mp_keys tempState = _mp_state ^ toggle;
+
+	sreg = SREG;
+	cli();
+	_mp_state = tempState;
+	SREG = sreg;
+
+	// Log an event for each button that changed. Buttons are active low.
+	uint16_t time = millis();
+	mp_keys mask = 1;
+	for(uint8_t i = 0; i < MP_NUM_KEYS; ++i, mask <<= 1){
+		if(toggle & mask){
+			mp_pushEvent(i, (tempState & mask) ? MP_EVENT_RELEASE : MP_EVENT_PRESS, time);
 		}
+	}
 
-		// If the delay of this button is more than debounce delay since last change, 
-		// we update the current active value.
-		if((now != pState) && ((_mp_tTime - _mp_time[i]) > _mp_debounceDelay)){
-//			ml_setLed(i, ~now);
-			// Copy the previous state.
-			_mp_pState = _mp_state;
-			uint16_t tempState = _mp_pState;
-			// Replace the right bit by the new value. We use a temp value to avoid problems with
-			// interrupts firing during reading.
-			tempState &= ~_BV(i);
-			tempState |= (_mp_now & _BV(i));
-
-			// Then we update the global value.
-			uint8_t sreg = SREG;
-			cli();
-			_mp_state = tempState;
-			SREG = sreg;
-
-			// And set a flag for return value.
-			change = true;
+	return true;
+}
+
+//Add an event to the buffer. When it's full the event is dropped and counted as overflow.
+void mp_pushEvent(uint8_t key, uint8_t type, uint16_t time){
+	uint8_t head = _mp_eventHead;
+	uint8_t next = (head + 1) & (MP_EVENT_SIZE - 1);
+
+	if(next == _mp_eventTail){
+		uint8_t sreg = SREG;
+		cli();
+		if(_mp_eventOverflow < 0xFF){
+			_mp_eventOverflow++;
 		}
+		SREG = sreg;
+		return;
+	}
+
+	_mp_event[head].type = type;
+	_mp_event[head].key = key;
+	_mp_event[head].time = time;
+
+	// The event is complete before to be published.
+	_mp_eventHead = next;
+}
+
+//Get the oldest event from the buffer. Returns false if there is none.
+bool mp_getEvent(mp_event *event){
+	uint8_t tail = _mp_eventTail;
+
+	if(tail == _mp_eventHead){
+		return false;
 	}
 
-//	ml_update();
-	return change;
-}
\ No newline at end of file
+	*event = _mp_event[tail];
+	_mp_eventTail = (tail + 1) & (MP_EVENT_SIZE - 1);
+	return true;
+}
+
+//Get the number of events waiting in the buffer.
+uint8_t mp_getEventCount(){
+	return (_mp_eventHead - _mp_eventTail) & (MP_EVENT_SIZE - 1);
+}
+
+//Get the number of events lost since last call, and clear it.
+uint8_t mp_getEventOverflow(){
+	uint8_t sreg = SREG;
+	cli();
+	uint8_t overflow = _mp_eventOverflow;
+	_mp_eventOverflow = 0;
+	SREG = sreg;
+	return overflow;
+}
@@ -21,18 +21,96 @@
 #ifndef MOKA_PAD_H
 #define MOKA_PAD_H
 
-#include <Arduino.h>
+#include "moka_hal.h"
 
 //extern bool _mp_int;
 
+//Keypad size, chosen at compile time, up to 8 rows of 8 columns.
+//Key states are one bit per key, row after row, in the smallest type that holds them all.
+#ifndef MP_ROWS
+#define MP_ROWS 4
+#endif
+
+#ifndef MP_COLS
+#define MP_COLS 4
+#endif
+
+#if (MP_ROWS > 8) || (MP_COLS > 8)
+#error "MP_ROWS and MP_COLS are 8 at most: rows are driven and columns read on one 8 bits port each"
+#endif
+
+#define MP_NUM_KEYS (MP_ROWS * MP_COLS)
+
+#if MP_NUM_KEYS <= 16
+typedef uint16_t mp_keys;
+#elif MP_NUM_KEYS <= 32
+typedef uint32_t mp_keys;
+#else
+typedef uint64_t mp_keys;
+#endif
+
+//All the keys of the pad.
+const mp_keys MP_ALL_KEYS = (mp_keys)~(mp_keys)0 >> (8 * sizeof(mp_keys) - MP_NUM_KEYS);
+
+//Keypad wiring: columns are read on one port and rows driven on another, both from bit 0.
+//The moka board has its columns on PC0-PC3 and its rows on PD0-PD3. Larger pads set their own ports:
+//PC4-PC5 are the TWI lines and PD4-PD7 the address jumpers, so the default wiring stops at 4 rows and 4 columns.
+#ifndef MP_COL_PIN
+#if (MP_ROWS > 4) || (MP_COLS > 4)
+#error "Pads larger than 4x4 need their own ports: define MP_COL_PIN, MP_COL_PORT, MP_COL_DDR, MP_ROW_PORT and MP_ROW_DDR"
+#endif
+#define MP_COL_PIN	PINC
+#define MP_COL_PORT	PORTC
+#define MP_COL_DDR	DDRC
+#define MP_ROW_PORT	PORTD
+#define MP_ROW_DDR	DDRD
+#endif
+
+const uint8_t MP_COL_MASK = (uint8_t)((1 << MP_COLS) - 1);
+const uint8_t MP_ROW_MASK = (uint8_t)((1 << MP_ROWS) - 1);
+
+//Default scan settings: a row is driven 250us before to be read, and a scan is one tick per row,
+//so the whole 4 rows pad is read every ms.
+const uint16_t MP_SETTLE_TIME = 250;
+const uint8_t MP_SCAN_TICKS = MP_ROWS;
+
+//Key events, logged by mp_update() for each button change, and read back by the master.
+//The timestamp is the low 16 bits of millis().
+const uint8_t MP_EVENT_RELEASE = 0;
+const uint8_t MP_EVENT_PRESS = 1;
+//Gesture events, logged by mg_update() when enabled. A held event follows a release, its time is the hold duration.
+const uint8_t MP_EVENT_LONG = 2;
+const uint8_t MP_EVENT_DOUBLE = 3;
+const uint8_t MP_EVENT_REPEAT = 4;
+const uint8_t MP_EVENT_HELD = 5;
+
+//Event buffer size, must be a power of 2. One slot is kept empty, so it holds 15 events.
+const uint8_t MP_EVENT_SIZE = 16;
+
+struct mp_event{
+	uint8_t type;
+	uint8_t key;
+	uint16_t time;
+};
+
 void mp_init();
 
+void mp_setSettleTime(uint16_t settle);
+void mp_setScanTicks(uint8_t ticks);
 void mp_setDebounceDelay(uint16_t);
+uint16_t mp_getDebounceDelay();
+void mp_computeDebounce();
 
 bool mp_getButton(uint8_t button);
-uint16_t mp_getButtons();
+mp_keys mp_getButtons();
 
+bool mp_isScanReady();
 bool mp_update();
 
+void mp_pushEvent(uint8_t key, uint8_t type, uint16_t time);
+bool mp_getEvent(mp_event *event);
+uint8_t mp_getEventCount();
+uint8_t mp_getEventOverflow();
+
 
 #endif
\ No newline at end of file
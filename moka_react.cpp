@@ -0,0 +1,134 @@
+//Key reactions for the moka board
+
+/*
+ * This is a library for lighting Moka leds locally from key events
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "moka_react.h"
+
+#include "moka_leds.h"
+
+// Each key can drive the led at the same position, without the master:
+// rules are applied from the pad task, right after the scan that changed the key state,
+// so the led is shown within the same scheduler pass instead of after a poll and two commands.
+// A rule is the action in its low bits, MR_COLOR, and the radio group in its high nibble.
+// The rule color is an 8 bits color, like SET_ONE_LED in 8 bits mode.
+
+uint8_t _mr_rule[NUM_LED];
+uint8_t _mr_color[NUM_LED];
+
+//Leds that have a rule, one bit per led.
+ml_leds _mr_active = 0;
+
+//Key state seen at the last update, pressed keys are set. Key n drives led n, so it is kept as leds.
+ml_leds _mr_buttons = 0;
+
+//Set the rule of a key. MR_NONE leaves the led to the master again.
+void mr_setRule(uint8_t key, uint8_t rule, uint8_t color){
+	_mr_rule[key] = rule;
+	_mr_color[key] = color;
+
+	if((rule & MR_ACTION_MASK) == MR_NONE){
+		_mr_active &= ~ML_LED(key);
+	} else {
+		_mr_active |= ML_LED(key);
+	}
+}
+
+//Get the rule of a key.
+uint8_t mr_getRule(uint8_t key){
+	return _mr_rule[key];
+}
+
+//Get the rule color of a key.
+uint8_t mr_getColor(uint8_t key){
+	return _mr_color[key];
+}
+
+//Remove all rules.
+void mr_clrRules(){
+	for(uint8_t i = 0; i < NUM_LED; i++){
+		mr_setRule(i, MR_NONE, 0);
+	}
+}
+
+//Light a led from its key, with the rule color if it has one.
+void mr_light(uint8_t key, ml_leds *state){
+	if(_mr_rule[key] & MR_COLOR){
+		ml_setColor(key, _mr_color[key]);
+	}
+	*state |= ML_LED(key);
+}
+
+// Apply the rules to the keys that changed. Buttons are the debounced state, pressed keys set.
+// Returns true if a led was changed, so it can be shown at once.
+bool mr_update(mp_keys buttons){
+	ml_leds keys = (ml_leds)buttons;
+	ml_leds changed = (keys ^ _mr_buttons) & _mr_active;
+	_mr_buttons = keys;
+
+	if(!changed){
+		return false;
+	}
+
+	ml_leds state = ml_getLed();
+	ml_leds mask = 1;
+	for(uint8_t i = 0; i < NUM_LED; i++, mask <<= 1){
+		if(!(changed & mask)){
+			continue;
+		}
+
+		bool pressed = keys & mask;
+		uint8_t rule = _mr_rule[i];
+
+		switch(rule & MR_ACTION_MASK){
+			case MR_HOLD:
+				if(pressed){
+					mr_light(i, &state);
+				} else {
+					state &= ~mask;
+				}
+				break;
+
+			case MR_TOGGLE:
+				if(pressed){
+					if(state & mask){
+						state &= ~mask;
+					} else {
+						mr_light(i, &state);
+					}
+				}
+				break;
+
+			case MR_RADIO:
+				if(pressed){
+					for(uint8_t j = 0; j < NUM_LED; j++){
+						if(((_mr_rule[j] & MR_ACTION_MASK) == MR_RADIO) &&
+								((_mr_rule[j] ^ rule) >> MR_GROUP_SHIFT) == 0){
+							state &= ~ML_LED(j);
+						}
+					}
+					mr_light(i, &state);
+				}
+				break;
+		}
+	}
+
+	ml_setLed(state);
+
+	return true;
+}
@@ -0,0 +1,48 @@
+//Key reactions for the moka board
+
+/*
+ * This is a library for lighting Moka leds locally from key events
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOKA_REACT_H
+#define MOKA_REACT_H
+
+#include "moka_hal.h"
+
+#include "moka_pad.h"
+
+//Reaction of a led to its key, low bits of a rule.
+const uint8_t MR_NONE = 0;		// the led is left to the master
+const uint8_t MR_HOLD = 1;		// the led is lit while the key is held
+const uint8_t MR_TOGGLE = 2;	// the led toggles on each press
+const uint8_t MR_RADIO = 3;		// the led is lit on press, and the other leds of its group are shut
+const uint8_t MR_ACTION_MASK = 0x07;
+
+//Set with the action, the led also takes the rule color when it is lit by its key.
+const uint8_t MR_COLOR = 0x08;
+
+//Radio group, high nibble of a rule.
+const uint8_t MR_GROUP_SHIFT = 4;
+
+void mr_setRule(uint8_t key, uint8_t rule, uint8_t color);
+uint8_t mr_getRule(uint8_t key);
+uint8_t mr_getColor(uint8_t key);
+void mr_clrRules();
+
+bool mr_update(mp_keys buttons);
+
+#endif
@@ -0,0 +1,200 @@
+//Task scheduler for the moka board
+
+/*
+ * This is a library for running the moka board firmware tasks
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "moka_sched.h"
+
+#include "moka_pad.h"
+#include "moka_leds.h"
+#include "moka_twi.h"
+#include "moka_fade.h"
+#include "moka_react.h"
+#include "moka_gesture.h"
+#include "moka_bench.h"
+
+// Cooperative scheduler. Each task runs periodically, from a fixed table, in the table order.
+// A task is released every period, and misses its deadline when it starts later than the deadline after its release.
+// Missed periods are skipped: a late task runs once, and is released again a period after it ran.
+// The pad task is also released as soon as a keypad scan is ready, so each scan is read before the next one completes,
+// whatever the scan period, and the command task as soon as a latched frame is waiting to be sent.
+// When no task is due, the CPU sleeps in idle mode until the next interrupt:
+// timer 2 ticks every 250us for the keypad, so the scheduler checks at least as often.
+// Times are in us.
+
+struct mk_task{
+	void (*run)();
+	uint16_t period;
+	uint16_t deadline;
+	uint32_t release;
+	uint16_t misses;
+	uint16_t maxTime;
+};
+
+// Key reactions are shown at once, without waiting for the refresh task.
+// Gestures are updated even when no key changed, for the timed ones.
+void mk_padTask(){
+	MB_BEGIN(MB_PAD_UPDATE);
+	bool changed = mp_update();
+	mp_keys buttons = mp_getButtons();
+	if(changed && mr_update(buttons)){
+		ml_update();
+	}
+	mg_update(buttons);
+	MB_END(MB_PAD_UPDATE);
+}
+
+void mk_commandTask(){
+	mw_update();
+}
+
+void mk_animationTask(){
+	ml_blink();
+	mf_update();
+}
+
+void mk_refreshTask(){
+	ml_update();
+}
+
+//The task table. The pad task runs at least every ms for the timed gestures, and on each keypad scan.
+mk_task _mk_tasks[MK_NUM_TASKS] = {
+	{mk_padTask, 1000, 1000, 0, 0, 0},
+	{mk_commandTask, 1000, 2000, 0, 0, 0},
+	{mk_animationTask, 5000, 5000, 0, 0, 0},
+	{mk_refreshTask, MK_FRAME_TIME, 5000, 0, 0, 0},
+};
+
+//Time spent sleeping since the last idle measure, and start of that measure.
+//The idle ratio, in per thousand, is computed every second.
+uint32_t _mk_idleTime = 0;
+uint32_t _mk_idleStart = 0;
+uint16_t _mk_idle = 0;
+
+// Init the scheduler. All tasks are released at once.
+void mk_init(){
+	uint32_t now = micros();
+	for(uint8_t i = 0; i < MK_NUM_TASKS; i++){
+		_mk_tasks[i].release = now;
+	}
+	_mk_idleStart = now;
+
+	set_sleep_mode(SLEEP_MODE_IDLE);
+}
+
+// Run the tasks that are due. To be called from the loop.
+// Returns false when no task was due.
+bool mk_update(){
+	bool ran = false;
+
+	// A ready scan releases the pad task now, unless it's already due.
+	mk_task *pad = &_mk_tasks[MK_TASK_PAD];
+	if(mp_isScanReady() && ((int32_t)(micros() - pad->release) < 0)){
+		pad->release = micros();
+	}
+
+	// A latched frame releases the command task now, so boards show a broadcast frame together.
+	mk_task *command = &_mk_tasks[MK_TASK_COMMAND];
+	if(mw_isOutputPending() && ((int32_t)(micros() - command->release) < 0)){
+		command->release = micros();
+	}
+
+	for(uint8_t i = 0; i < MK_NUM_TASKS; i++){
+		mk_task *task = &_mk_tasks[i];
+		uint32_t now = micros();
+		uint32_t late = now - task->release;
+
+		// Not released yet. Release times can be ahead of now, so the difference is signed.
+		if((int32_t)late < 0){
+			continue;
+		}
+
+		// Statistics are read from the TWI interrupt, so they are written with interrupts masked.
+		uint8_t sreg;
+		if(late > task->deadline){
+			sreg = SREG;
+			cli();
+			task->misses++;
+			SREG = sreg;
+		}
+
+		task->run();
+		ran = true;
+
+		uint32_t time = micros() - now;
+		if(time > task->maxTime){
+			sreg = SREG;
+			cli();
+			task->maxTime = (time > 0xFFFF) ? 0xFFFF : time;
+			SREG = sreg;
+		}
+
+		task->release += task->period;
+		if((int32_t)(now - task->release) >= 0){
+			task->release = now + task->period;
+		}
+	}
+
+	return ran;
+}
+
+// Sleep until the next interrupt. To be called from the loop when no task was due.
+void mk_sleep(){
+	uint32_t now = micros();
+	if((now - _mk_idleStart) >= 1000000UL){
+		uint16_t idle = (uint16_t)(_mk_idleTime / ((now - _mk_idleStart) / 1000));
+		uint8_t sreg = SREG;
+		cli();
+		_mk_idle = idle;
+		SREG = sreg;
+		_mk_idleTime = 0;
+		_mk_idleStart = now;
+	}
+
+	sleep_enable();
+	sleep_cpu();
+	sleep_disable();
+
+	_mk_idleTime += micros() - now;
+}
+
+// Get the number of deadlines missed by a task.
+uint16_t mk_getMisses(uint8_t task){
+	return _mk_tasks[task].misses;
+}
+
+// Get the longest run of a task, in us.
+uint16_t mk_getMaxTime(uint8_t task){
+	return _mk_tasks[task].maxTime;
+}
+
+// Get the time spent sleeping over the last second, in per thousand.
+uint16_t mk_getIdle(){
+	return _mk_idle;
+}
+
+// Reset task statistics.
+void mk_resetStats(){
+	uint8_t sreg = SREG;
+	cli();
+	for(uint8_t i = 0; i < MK_NUM_TASKS; i++){
+		_mk_tasks[i].misses = 0;
+		_mk_tasks[i].maxTime = 0;
+	}
+	SREG = sreg;
+}
@@ -0,0 +1,45 @@
+//Task scheduler for the moka board
+
+/*
+ * This is a library for running the moka board firmware tasks
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOKA_SCHED_H
+#define MOKA_SCHED_H
+
+#include "moka_hal.h"
+
+//Task ids, in the task table order.
+const uint8_t MK_TASK_PAD = 0;			// key scan reading, debounce and events
+const uint8_t MK_TASK_COMMAND = 1;		// TWI command queue
+const uint8_t MK_TASK_ANIMATION = 2;	// blink and fades
+const uint8_t MK_TASK_REFRESH = 3;		// led refresh
+const uint8_t MK_NUM_TASKS = 4;
+
+//Time between two led refreshes, in us. This caps the frame rate to 100 frames per second.
+const uint16_t MK_FRAME_TIME = 10000;
+
+void mk_init();
+bool mk_update();
+void mk_sleep();
+
+uint16_t mk_getMisses(uint8_t task);
+uint16_t mk_getMaxTime(uint8_t task);
+uint16_t mk_getIdle();
+void mk_resetStats();
+
+#endif
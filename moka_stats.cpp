@@ -0,0 +1,179 @@
+//Performance counters for the moka board
+
+/*
+ * This is a library for measuring the moka board firmware at run time
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "moka_stats.h"
+
+// Counters are fed by hooks in the pad, leds and TWI code, and read as one block over TWI.
+// Times are in us, from micros(), so they have its 8us resolution at 8MHz.
+// The block is read from the TWI interrupt, so counters it reads are written from the loop with interrupts masked:
+// a 16 or 32 bits value is stored a byte at a time, and the interrupt could read it half written.
+
+#if MS_STATS
+
+//Loop time: time spent running tasks in a loop, max and average. Loops that only sleep are not counted.
+//The average is kept times 8, and moves by 1/8 of the difference each loop.
+//Loop time holds the start of the current loop.
+uint32_t _ms_loopTime = 0;
+uint16_t _ms_loopMax = 0;
+uint32_t _ms_loopAverage = 0;
+
+//Scans counted over a second, and the count of the last full second.
+uint16_t _ms_scans = 0;
+uint16_t _ms_scanRate = 0;
+uint32_t _ms_scanTime = 0;
+
+uint16_t _ms_refreshes = 0;
+
+//Longest time interrupts were masked while sending a frame.
+uint32_t _ms_maskTime;
+uint16_t _ms_maskMax = 0;
+
+//These are counted from the TWI interrupt.
+volatile uint16_t _ms_twiBytes = 0;
+volatile uint8_t _ms_malformed = 0;
+volatile uint8_t _ms_queueOverflows = 0;
+
+// Call at the start of each loop.
+void ms_loopStart(){
+	_ms_loopTime = micros();
+
+	uint32_t ms = millis();
+	if((ms - _ms_scanTime) >= 1000){
+		_ms_scanTime = ms;
+		uint8_t sreg = SREG;
+		cli();
+		_ms_scanRate = _ms_scans;
+		SREG = sreg;
+		_ms_scans = 0;
+	}
+}
+
+// Call at the end of a loop that ran tasks, before sleeping.
+void ms_loopEnd(){
+	uint32_t time = micros() - _ms_loopTime;
+	if(time > 0xFFFF){
+		time = 0xFFFF;
+	}
+
+	uint8_t sreg = SREG;
+	cli();
+	if(time > _ms_loopMax){
+		_ms_loopMax = time;
+	}
+	_ms_loopAverage += time - (_ms_loopAverage >> 3);
+	SREG = sreg;
+}
+
+// Call for each keypad scan processed.
+void ms_scan(){
+	_ms_scans++;
+}
+
+// Call for each frame sent to the leds.
+void ms_refresh(){
+	uint8_t sreg = SREG;
+	cli();
+	_ms_refreshes++;
+	SREG = sreg;
+}
+
+// Call before and after interrupts are masked.
+void ms_maskStart(){
+	_ms_maskTime = micros();
+}
+
+void ms_maskEnd(){
+	uint32_t time = micros() - _ms_maskTime;
+	if(time > _ms_maskMax){
+		uint8_t sreg = SREG;
+		cli();
+		_ms_maskMax = (time > 0xFFFF) ? 0xFFFF : time;
+		SREG = sreg;
+	}
+}
+
+// Call for each TWI byte received.
+void ms_twiByte(){
+	_ms_twiBytes++;
+}
+
+// Call for each unknown or incomplete command.
+void ms_malformed(){
+	if(_ms_malformed < 0xFF){
+		_ms_malformed++;
+	}
+}
+
+// Call for each command dropped because the queue was full.
+void ms_queueOverflow(){
+	if(_ms_queueOverflows < 0xFF){
+		_ms_queueOverflows++;
+	}
+}
+
+// Write the status block. It's called from the TWI interrupt, so all the counters are from the same time,
+// and none is half written.
+void ms_getStatus(uint8_t *block){
+	uint16_t values[6] = {
+		_ms_loopMax,
+		(uint16_t)(_ms_loopAverage >> 3),
+		_ms_scanRate,
+		_ms_refreshes,
+		_ms_maskMax,
+		_ms_twiBytes,
+	};
+
+	for(uint8_t i = 0; i < 6; i++){
+		block[2 * i] = (uint8_t)(values[i] >> 8);
+		block[2 * i + 1] = (uint8_t)(values[i] & 0xFF);
+	}
+	block[12] = _ms_malformed;
+	block[13] = _ms_queueOverflows;
+}
+
+// Reset all counters.
+void ms_reset(){
+	uint8_t sreg = SREG;
+	cli();
+
+	_ms_loopMax = 0;
+	_ms_loopAverage = 0;
+	_ms_scans = 0;
+	_ms_scanRate = 0;
+	_ms_scanTime = millis();
+	_ms_refreshes = 0;
+	_ms_maskMax = 0;
+	_ms_twiBytes = 0;
+	_ms_malformed = 0;
+	_ms_queueOverflows = 0;
+
+	SREG = sreg;
+}
+
+#else
+
+void ms_getStatus(uint8_t *block){
+	memset(block, 0, MS_STATUS_SIZE);
+}
+
+void ms_reset(){
+}
+
+#endif
@@ -0,0 +1,65 @@
+//Performance counters for the moka board
+
+/*
+ * This is a library for measuring the moka board firmware at run time
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOKA_STATS_H
+#define MOKA_STATS_H
+
+#include "moka_hal.h"
+
+//Counters are compiled in by default. With MS_STATS set to 0 the hooks are empty and the status block reads as zeros.
+#ifndef MS_STATS
+#define MS_STATS 1
+#endif
+
+//Status block, 16 bits values msb first:
+//loop max (us), loop average (us), scans per second, led refreshes, interrupts masked max (us),
+//TWI bytes received, then malformed commands and queue overflows on one byte each.
+const uint8_t MS_STATUS_SIZE = 14;
+
+#if MS_STATS
+
+void ms_loopStart();
+void ms_loopEnd();
+void ms_scan();
+void ms_refresh();
+void ms_maskStart();
+void ms_maskEnd();
+void ms_twiByte();
+void ms_malformed();
+void ms_queueOverflow();
+
+#else
+
+inline void ms_loopStart(){}
+inline void ms_loopEnd(){}
+inline void ms_scan(){}
+inline void ms_refresh(){}
+inline void ms_maskStart(){}
+inline void ms_maskEnd(){}
+inline void ms_twiByte(){}
+inline void ms_malformed(){}
+inline void ms_queueOverflow(){}
+
+#endif
+
+void ms_getStatus(uint8_t *block);
+void ms_reset();
+
+#endif
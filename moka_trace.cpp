@@ -0,0 +1,181 @@
+//TWI traces for the moka board
+
+/*
+ * This is a library for capturing and replaying TWI traffic to the moka board
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// This file is empty on the board.
+#ifndef __AVR__
+
+#include "moka_trace.h"
+#include "moka_stats.h"
+
+//Start time of the last transaction recorded.
+uint32_t _mt_time = 0;
+
+// Start a trace.
+void mt_open(FILE *file){
+	fwrite("MKT1", 1, 4, file);
+	_mt_time = micros();
+}
+
+// Record a transaction, started at the given time.
+void mt_record(FILE *file, uint8_t address, uint32_t time, const uint8_t *data, uint8_t length){
+	uint32_t delta = time - _mt_time;
+	_mt_time = time;
+
+	fputc(address, file);
+	do{
+		uint8_t data7 = delta & 0x7F;
+		delta >>= 7;
+		fputc(delta ? (data7 | 0x80) : data7, file);
+	} while(delta);
+	fputc(length, file);
+
+	if(!(address & MT_READ)){
+		fwrite(data, 1, length, file);
+	}
+}
+
+// Send a write with the host TWI master, and record it.
+bool mt_write(FILE *file, uint8_t address, const uint8_t *data, uint8_t length){
+	mt_record(file, address, micros(), data, length);
+	return mh_hostTwiWrite(address, data, length);
+}
+
+// Send a read with the host TWI master, and record it.
+bool mt_read(FILE *file, uint8_t address, uint8_t *data, uint8_t length){
+	mt_record(file, address | MT_READ, micros(), NULL, length);
+	return mh_hostTwiRead(address, data, length);
+}
+
+// Let the time go on, running the loop every MT_LOOP_TIME.
+void mt_run(uint32_t time, void (*loop)()){
+	while(time > 0){
+		uint32_t step = (time < MT_LOOP_TIME) ? time : MT_LOOP_TIME;
+		mh_hostAdvance(step);
+		time -= step;
+		if(loop != NULL){
+			loop();
+		}
+	}
+}
+
+// Replay a trace to the board at the host TWI address, from the current emulated time.
+// Transactions to other addresses aren't acknowledged by the board, so they count as nacks, but their time is kept.
+// Returns false if the trace is not valid, the report then covers what was replayed.
+bool mt_replay(FILE *file, void (*loop)(), mt_report *report){
+	memset(report, 0, sizeof(mt_report));
+
+	char magic[4];
+	if((fread(magic, 1, 4, file) != 4) || (memcmp(magic, "MKT1", 4) != 0)){
+		return false;
+	}
+
+	uint8_t status[MS_STATUS_SIZE];
+	ms_getStatus(status);
+	uint8_t malformed = status[12];
+	uint8_t dropped = status[13];
+	uint32_t frames = mh_hostGetFrameCount();
+	uint32_t start = micros();
+	uint32_t end = start;
+
+	uint8_t data[0xFF];
+	bool valid = true;
+
+	for(;;){
+		int address = fgetc(file);
+		if(address == EOF){
+			break;
+		}
+
+		uint32_t delta = 0;
+		uint8_t shift = 0;
+		int data7;
+		do{
+			data7 = fgetc(file);
+			delta |= (uint32_t)(data7 & 0x7F) << shift;
+			shift += 7;
+		} while((data7 != EOF) && (data7 & 0x80) && (shift < 32));
+
+		int length = fgetc(file);
+		if((data7 == EOF) || (data7 & 0x80) || (length == EOF)){
+			valid = false;
+			break;
+		}
+
+		bool read = address & MT_READ;
+		if(!read && (fread(data, 1, length, file) != (size_t)length)){
+			valid = false;
+			break;
+		}
+
+		// The transaction starts once the previous one, and the time between them, are over.
+		uint32_t now = micros();
+		if(now - end < delta){
+			mt_run(delta - (now - end), loop);
+		}
+		end = micros();
+
+		address &= ~MT_READ;
+		bool ack = read ? mh_hostTwiRead(address, data, length) : mh_hostTwiWrite(address, data, length);
+
+		report->transactions++;
+		report->bytes += length + 1;
+		report->busTime += (uint32_t)(length + 1) * MH_HOST_TWI_BYTE_TIME;
+		if(!ack){
+			report->nacks++;
+		}
+	}
+
+	// Let the last commands be executed.
+	mt_run(MT_LOOP_TIME, loop);
+
+	ms_getStatus(status);
+	report->malformed = status[12] - malformed;
+	report->dropped = status[13] - dropped;
+	report->frames = mh_hostGetFrameCount() - frames;
+	report->duration = micros() - start;
+	memcpy(report->frame, mh_hostGetFrame(), NUM_LED * 3);
+
+	return valid;
+}
+
+// Print a report, one key=value per line.
+// The bus load is the time used by the transactions over the trace duration, in per thousand.
+// As many boards as fit in the remaining bus time could be driven the same way.
+void mt_printReport(FILE *file, const mt_report *report){
+	uint32_t load = report->duration ? (uint32_t)((uint64_t)report->busTime * 1000 / report->duration) : 0;
+
+	fprintf(file, "transactions=%lu\n", (unsigned long)report->transactions);
+	fprintf(file, "nacks=%lu\n", (unsigned long)report->nacks);
+	fprintf(file, "bytes=%lu\n", (unsigned long)report->bytes);
+	fprintf(file, "duration_us=%lu\n", (unsigned long)report->duration);
+	fprintf(file, "bytes_per_s=%lu\n", report->duration ? (unsigned long)((uint64_t)report->bytes * 1000000 / report->duration) : 0UL);
+	fprintf(file, "bus_load_permil=%lu\n", (unsigned long)load);
+	fprintf(file, "boards_per_bus=%lu\n", report->busTime ? (unsigned long)(report->duration / report->busTime) : 0UL);
+	fprintf(file, "malformed=%u\n", report->malformed);
+	fprintf(file, "dropped=%u\n", report->dropped);
+	fprintf(file, "frames=%lu\n", (unsigned long)report->frames);
+	fprintf(file, "last_frame=");
+	for(uint8_t i = 0; i < NUM_LED * 3; i++){
+		fprintf(file, "%02x", report->frame[i]);
+	}
+	fprintf(file, "\n");
+}
+
+#endif
@@ -0,0 +1,69 @@
+//TWI traces for the moka board
+
+/*
+ * This is a library for capturing and replaying TWI traffic to the moka board
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOKA_TRACE_H
+#define MOKA_TRACE_H
+
+// Traces are for the host build only.
+#ifndef __AVR__
+
+#include <stdio.h>
+
+#include "moka_hal.h"
+#include "moka_leds.h"
+
+// Trace format. A trace starts with the 4 bytes "MKT1", followed by one record per TWI transaction:
+//		address		1 byte, bit 7 set for a read, address 0 for a general call
+//		time		time since the previous transaction started, in us, 7 bits per byte, lsb first,
+//					bit 7 set on all bytes but the last
+//		length		1 byte, number of bytes written or read
+//		data		the bytes written, nothing for a read
+// A master, or a bus sniffer, records the same format with mt_record(). mt_write() and mt_read() record
+// the transactions of the host TWI master as they are sent.
+// test/moka_replay replays a trace file to the host build and prints its report: make -C test moka_replay
+
+const uint8_t MT_READ = 0x80;
+
+//Time between two loops while replaying, in us.
+const uint16_t MT_LOOP_TIME = 100;
+
+struct mt_report{
+	uint32_t transactions;
+	uint32_t nacks;
+	uint32_t bytes;
+	uint32_t duration;		// trace duration, in us
+	uint32_t busTime;		// time the bus was used by the transactions, in us
+	uint8_t malformed;		// unknown or incomplete commands
+	uint8_t dropped;		// commands dropped by a full queue
+	uint32_t frames;		// frames sent to the leds
+	uint8_t frame[NUM_LED * 3];		// last frame sent, GRB
+};
+
+void mt_open(FILE *file);
+void mt_record(FILE *file, uint8_t address, uint32_t time, const uint8_t *data, uint8_t length);
+bool mt_write(FILE *file, uint8_t address, const uint8_t *data, uint8_t length);
+bool mt_read(FILE *file, uint8_t address, uint8_t *data, uint8_t length);
+
+bool mt_replay(FILE *file, void (*loop)(), mt_report *report);
+void mt_printReport(FILE *file, const mt_report *report);
+
+#endif
+
+#endif
@@ -17,33 +17,45 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-
 #include "moka_twi.h"
 
 #include "moka_leds.h"
 #include "moka_pad.h"
-
-#include <Wire.h>
+#include "moka_fade.h"
+#include "moka_stats.h"
+#include "moka_bench.h"
+#include "moka_sched.h"
+#include "moka_react.h"
+#include "moka_gesture.h"
 
 /* This file manages TWI communication, and dispatch requests from master to slave functions
  * The master can send or request data
- * Data sent is managed by mw_receivedhandler()
- * Data request is managed by mw_requestHandler();
+ * Data sent is managed by mw_receiveHandler(), one byte at a time, as it arrives.
+ * Data request is managed by mw_requestHandler(), that gives the bytes to send one at a time.
  *
  * A data send will be typically an instruction byte from master,
- * followed by one or more data byte(s) from master to slave
+ * followed by one or more data byte(s) from master to slave.
+ * Each command has a known number of data bytes, so a data send can carry several commands back to back.
  * A data request will be typically an instruction byte,
  * followed by one or more data byte(s) from slave to master.
+ *
+ * The TWI hardware is driven directly by the TWI interrupt, without intermediate buffer:
+ * Led colors are written in the staged frame as bytes arrive, so there is no limit on the frame length.
+ *
+ * The staged frame is shown by UPDATE_LEDS or REFRESH_LEDS, or by LATCH.
+ * LATCH is meant to be sent by general call, so all the boards on the bus show their frame at once.
+ * Each board keeps the sequence number of the last frame latched, so the master can check none was missed.
  */
 
 //Led register
 
 const uint8_t SET_ONE_LED = 0x00;		// SET_ONE_LED | LedNumber + 1/3 bytes
 const uint8_t SET_GLOBAL_LED = 0x10;	// SET_GLOBAL + 1/3 bytes
-const uint8_t SET_ALL_LED = 0x20;		// SET_ALL + 16/72 bytes
-//const uint8_t GET_BUTTON = 0x30;		// GET_BUTTON | ButtonNumber + 1 byte from slave to master
-const uint8_t GET_BUTTONS = 0x40;		// GET_BUTTONS + 1 byte from slave to master
+const uint8_t SET_ALL_LED = 0x20;		// SET_ALL + 16/48 bytes
+const uint8_t SET_DELTA_LED = 0x30;		// SET_DELTA_LED + 2 bytes mask + 1/3 bytes per led in the mask
+const uint8_t GET_BUTTONS = 0x40;		// GET_BUTTONS + 2 bytes from slave to master
 const uint8_t LED_STATE = 0x50; 		// LED_STATE + 2 byte
+const uint8_t BRIGHTNESS = 0x51;		// BRIGHTNESS + 1 byte
 
 //System registers
 const uint8_t DISPLAY_STATE = 0x60;		// DISPLAY_STATE | State
@@ -52,29 +64,176 @@ const uint8_t BLINK_ON_DELAY = 0x80;	// BLINK_ON_DELAY + 2 bytes
 const uint8_t BLINK_OFF_DELAY = 0x81;	// BLINK_OFF_DELAY + 2 bytes
 const uint8_t DEBOUNCE_DELAY = 0x82;	// DEBOUNCE_DELAY + 1 byte
 
-const uint8_t HAS_CHANGED = 0x83;		// HAS_CHANGED + 1 byte from slave to master // INT emitted
+const uint8_t HAS_CHANGED = 0x83;		// HAS_CHANGED + 1 byte from slave to master, 1 when key events are waiting
+
+const uint8_t COLOR_MODE = 0x84; 		// COLOR_MODE | mode (0x84 to 0x87)
+
+const uint8_t GET_QUEUE = 0x88;			// GET_QUEUE + 2 bytes from slave to master
+const uint8_t GET_REFRESH = 0x89;		// GET_REFRESH + 4 bytes from slave to master
+const uint8_t BLINK_MASK = 0x8A;		// BLINK_MASK + 2 bytes
+
+const uint8_t LATCH = 0x8B;				// LATCH + 1 byte frame sequence, usually by general call
+const uint8_t GET_LATCH = 0x8C;			// GET_LATCH + 1 byte from slave to master
+
+const uint8_t GET_STATS = 0x8D;			// GET_STATS + 14 bytes status block from slave to master
+const uint8_t RESET_STATS = 0x8E;		// RESET_STATS
+const uint8_t GET_TASKS = 0x8F;			// GET_TASKS + 2 bytes idle + 4 bytes per task from slave to master
+
+const uint8_t GET_EVENTS = 0x90;		// GET_EVENTS | max events + 2 + 4 bytes per event from slave to master
 
-const uint8_t COLOR_MODE = 0x84; 		// COLOR_MODE | mode
+//Fade registers
+const uint8_t FADE_ONE_LED = 0xA0;		// FADE_ONE_LED | LedNumber + easing + 2 bytes duration + 1/3 bytes
+const uint8_t FADE_ALL_LED = 0xB0;		// FADE_ALL_LED + easing + 2 bytes duration + 16/48 bytes
+
+//Palette register
+const uint8_t SET_PALETTE = 0xC0;		// SET_PALETTE | first index + 3 bytes per color
+
+//Key reaction register
+const uint8_t SET_RULE = 0xD0;			// SET_RULE | KeyNumber + 1 byte rule + 1 byte color
+
+//Register access
+const uint8_t REGISTER = 0xE0;			// REGISTER + address + n bytes, or + n bytes from slave to master
+
+//Gesture registers
+const uint8_t GESTURES = 0xE1;			// GESTURES + 1 byte gestures logged
+const uint8_t LONG_TIME = 0xE2;			// LONG_TIME + 2 bytes
+const uint8_t DOUBLE_TIME = 0xE3;		// DOUBLE_TIME + 2 bytes
+const uint8_t REPEAT_DELAY = 0xE4;		// REPEAT_DELAY + 2 bytes
+const uint8_t REPEAT_PERIOD = 0xE5;		// REPEAT_PERIOD + 2 bytes
 
 const uint8_t CLR_DISPLAY = 0xF0;		// CLR_DISPLAY
 const uint8_t UPDATE_LEDS = 0xF5;		// UPDATE_LEDS
+const uint8_t REFRESH_LEDS = 0xF6;		// REFRESH_LEDS
 
 const uint8_t RESET = 0xFF;				// RESET
 
+//Leds and keys reached by the 16 bits masks, by the register map and by the low nibble of commands.
+//Builds with more leds or keys only address the first 16 this way, the others are set off by masks.
+const uint8_t MW_MAP_LEDS = 16;
+
+//Low nibbles and register addresses are not checked against the build size.
+#if ML_NUM_LED < 16 || MP_NUM_KEYS < 16
+#error "The TWI map reaches 16 leds and 16 keys, builds need at least as many."
+#endif
+
 //TWI states
 const uint8_t TWI_SEND_IDLE = 0;
-const uint8_t TWI_SEND_BUTTON = 0x10;
 const uint8_t TWI_SEND_BUTTONS = 0x20;
-const uint8_t TWI_SEND_INT = 3;
+const uint8_t TWI_SEND_EVENTS = 0x30;
+const uint8_t TWI_SEND_QUEUE = 0x40;
+const uint8_t TWI_SEND_REFRESH = 0x50;
+const uint8_t TWI_SEND_REGISTER = 0x60;
+const uint8_t TWI_SEND_LATCH = 0x70;
+const uint8_t TWI_SEND_STATS = 0x80;
+const uint8_t TWI_SEND_TASKS = 0x90;
+const uint8_t TWI_SEND_CHANGED = 0xA0;
 
 uint8_t _mw_twiState = TWI_SEND_IDLE;
 
+//Max number of events sent on a GET_EVENTS request, when the master doesn't set it.
+const uint8_t MAX_EVENTS = 15;
+uint8_t _mw_maxEvents = MAX_EVENTS;
+
 //color mode
+//In palette mode a color is a 4 bits palette index: one byte per led for SET_ONE_LED and SET_GLOBAL_LED,
+//the index in the low nibble, and two leds per byte for SET_ALL_LED, first led in the high nibble.
 const uint8_t COLOR_MODE_8 = 0;
 const uint8_t COLOR_MODE_24 = 1;
+const uint8_t COLOR_MODE_PALETTE = 2;
 
 uint8_t _mw_colorMode = COLOR_MODE_8;
 
+//Receive state
+//The command is the first byte of a command, the count is the number of bytes received so far, command included.
+//Once the payload length is reached, the next byte is a new command, so a write can carry several commands.
+uint8_t _mw_command;
+uint8_t _mw_rxCount = 0;
+uint8_t _mw_rxLength;
+//Scratch bytes for commands which data are used once complete.
+uint8_t _mw_rxData[3];
+//Streamed colors are written from the led, channel by channel.
+uint8_t _mw_rxChannel;
+uint8_t _mw_rxLed;
+//Whether the stream goes to the stage frame, or to the fade targets.
+bool _mw_rxStage;
+//Leds sent by a delta frame.
+uint16_t _mw_rxMask;
+//Staged leds when the command started, restored if it's incomplete.
+ml_stageMark _mw_rxMark;
+
+//Colors are sent as RGB, and stored as GRB. This is the offset of each received channel.
+const uint8_t _mw_channelOffset[3] = {1, 0, 2};
+
+//Command queue
+//Commands that are not needed at once by the TWI are queued by the interrupt, and executed from the loop by mw_update().
+//The interrupt is the only writer of the head, mw_update() the only one of the tail.
+//Queue size must be a power of 2. One slot is kept empty, so it holds 15 commands.
+const uint8_t QUEUE_SIZE = 16;
+
+struct mw_queueEntry{
+	uint8_t command;
+	uint8_t data[3];
+};
+
+mw_queueEntry _mw_queue[QUEUE_SIZE];
+volatile uint8_t _mw_queueHead = 0;
+volatile uint8_t _mw_queueTail = 0;
+//Max number of commands waiting in the queue, and number of commands dropped because it was full.
+uint8_t _mw_queueHighWater = 0;
+uint8_t _mw_queueOverflow = 0;
+
+//Register map
+//A write to REGISTER sets the address, and the next bytes are written from it, address auto-incrementing.
+//A read after REGISTER reads from the address the same way.
+//16 bits registers are msb first. A write takes effect when the lsb is written,
+//and a read of the msb latches the lsb, so both bytes are from the same value.
+const uint8_t REG_COLOR = 0x00;			// 16 leds * RGB, written to the staged frame, read from the led table
+const uint8_t REG_LED_STATE = 0x30;		// 2 bytes, read / write
+const uint8_t REG_DISPLAY_STATE = 0x32;	// read / write
+const uint8_t REG_BLINK_STATE = 0x33;	// read / write
+const uint8_t REG_BLINK_ON = 0x34;		// 2 bytes, read / write
+const uint8_t REG_BLINK_OFF = 0x36;		// 2 bytes, read / write
+const uint8_t REG_BLINK_MASK = 0x38;	// 2 bytes, read / write
+const uint8_t REG_DEBOUNCE = 0x3A;		// read / write
+const uint8_t REG_COLOR_MODE = 0x3B;	// read / write
+const uint8_t REG_BRIGHTNESS = 0x3C;	// read / write
+const uint8_t REG_BUTTONS = 0x40;		// 2 bytes, read only
+const uint8_t REG_EVENT_COUNT = 0x42;	// read only
+const uint8_t REG_QUEUE_HIGH = 0x43;	// read only
+const uint8_t REG_QUEUE_OVERFLOW = 0x44;// read only
+const uint8_t REG_REFRESH_COUNT = 0x46;	// 2 bytes, read only
+const uint8_t REG_SKIP_COUNT = 0x48;	// 2 bytes, read only
+const uint8_t REG_LATCH = 0x4A;			// read only
+const uint8_t REG_PALETTE = 0x50;		// 16 colors * RGB, read / write
+const uint8_t REG_END = 0x80;
+
+uint8_t _mw_regAddress = 0;
+uint8_t _mw_regLatch;
+
+//Sequence number of the last frame latched.
+uint8_t _mw_latchSequence = 0;
+
+//Frame output requested by UPDATE_LEDS, REFRESH_LEDS and LATCH. The frame is latched from the interrupt as soon as
+//the request is complete, so bytes of the next frame can't get into it, and boards latch a broadcast together.
+//Sending it is flagged rather than queued, so a full queue can't drop the end of a batch: the frame is sent by
+//mw_update(), after the commands received before it. The command task is released at once for it.
+const uint8_t OUTPUT_UPDATE = 0x01;
+const uint8_t OUTPUT_REFRESH = 0x02;
+
+volatile uint8_t _mw_output = 0;
+
+//Request state
+uint8_t _mw_txCount;
+uint8_t _mw_txEvents;
+uint16_t _mw_txRefresh;
+uint16_t _mw_txSkip;
+mp_event _mw_txEvent;
+uint16_t _mw_txButtons;
+uint16_t _mw_txValue;
+uint8_t _mw_txStats[MS_STATUS_SIZE];
+
+//TWCR value to go on as slave, acknowledging the next byte.
+const uint8_t TWI_ACK = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE);
 
 const uint8_t baseAddress = 10;
 uint8_t twiAddress = baseAddress;
@@ -113,130 +272,906 @@ void mw_init(){
     // Add the jumper offset to the device address.
     twiAddress = baseAddress + twiOffset;
 
-    Wire.begin(twiAddress);
+    // Set the slave address, and enable general call recognition, for broadcast addressing with address 0.
+    // SDA and SCL have external pullups, so the pins are left as inputs.
+    TWAR = (twiAddress << 1) | _BV(TWGCE);
+    TWCR = _BV(TWEA) | _BV(TWEN) | _BV(TWIE);
+}
+
+// TWI interrupt. Each step of a transaction lands here, the status register tells which one.
+// The TWI clock is stretched until TWINT is cleared, i.e. until TWCR is written back.
+ISR(TWI_vect){
+	MB_BEGIN(MB_TWI);
+
+	switch(TW_STATUS){
+		// Addressed for a write, by own address or general call.
+		case TW_SR_SLA_ACK:
+		case TW_SR_GCALL_ACK:
+		case TW_SR_ARB_LOST_SLA_ACK:
+		case TW_SR_ARB_LOST_GCALL_ACK:
+			_mw_rxCount = 0;
+			TWCR = TWI_ACK;
+			break;
+
+		// Data byte received.
+		case TW_SR_DATA_ACK:
+		case TW_SR_GCALL_DATA_ACK:
+			ms_twiByte();
+			mw_receiveHandler(TWDR);
+			TWCR = TWI_ACK;
+			break;
+
+		// Stop or repeated start, end of the write.
+		case TW_SR_STOP:
+			mw_stopHandler();
+			TWCR = TWI_ACK;
+			break;
+
+		// Addressed for a read, send the first byte.
+		case TW_ST_SLA_ACK:
+		case TW_ST_ARB_LOST_SLA_ACK:
+			_mw_txCount = 0;
+			TWDR = mw_requestHandler();
+			TWCR = TWI_ACK;
+			break;
+
+		// Byte sent and acknowledged by the master, send the next one.
+		case TW_ST_DATA_ACK:
+			TWDR = mw_requestHandler();
+			TWCR = TWI_ACK;
+			break;
 
-    // Enable general call recognition, for broadcast addressing with address 0.
-    TWAR |= _BV(TWGCE);
+		// The master doesn't want more bytes, end of the read.
+		case TW_ST_DATA_NACK:
+		case TW_ST_LAST_DATA:
+			_mw_twiState = TWI_SEND_IDLE;
+			TWCR = TWI_ACK;
+			break;
+
+		// Illegal start or stop, release the bus.
+		case TW_BUS_ERROR:
+			TWCR = TWI_ACK | _BV(TWSTO);
+			break;
 
-    Wire.onReceive(mw_receiveHandler);
-    Wire.onRequest(mw_requestHandler);
+		default:
+			TWCR = TWI_ACK;
+			break;
+	}
+
+	MB_VALUE(_mw_command);
+	MB_END(MB_TWI);
 }
 
-void mw_receiveHandler(int bytes){
-	uint8_t command = Wire.read();
+// Payload lengths
+// Most commands have a fixed number of data bytes. Color commands depend on the color mode,
+// and the stream commands take all the bytes up to the end of the write.
+// SET_DELTA_LED sets its own length, once its mask is received.
+const uint8_t LEN_COLOR = 0xF0;			// one color
+const uint8_t LEN_FRAME = 0xF1;			// one color per led
+const uint8_t LEN_FADE_ONE = 0xF2;		// easing, duration, one color
+const uint8_t LEN_FADE_ALL = 0xF3;		// easing, duration, one color per led
+const uint8_t LEN_STREAM = 0xFF;		// up to the end of the write
 
-	if(_mw_colorMode == COLOR_MODE_8){
-		if(((command ^ SET_ONE_LED) & 0xF0) == 0){
-			uint8_t value = Wire.read();
-			ml_setColor(command & 0x0F, value);
+//Color lengths for each color mode, in the order above.
+const uint8_t _mw_colorLength[3][4] = {
+	{1, NUM_LED, 3 + 1, 3 + NUM_LED},				// COLOR_MODE_8
+	{3, 3 * NUM_LED, 3 + 3, 3 + 3 * NUM_LED},		// COLOR_MODE_24
+	{1, NUM_LED / 2, 3 + 1, 3 + NUM_LED / 2},		// COLOR_MODE_PALETTE
+};
 
-		} else if(((command ^ SET_GLOBAL_LED) & 0xF0) == 0){
-			uint8_t value = Wire.read();
-			for(uint8_t i = 0; i < 16; i++){
-				ml_setColor(i, value);				
-			}
+// Receive functions are called with the command byte at index 0, then with each data byte.
+// Execute functions are called from the loop with the queued command and its data.
+typedef void (*mw_receiveFunction)(uint8_t command, uint8_t index, uint8_t data);
+typedef void (*mw_executeFunction)(uint8_t command, const uint8_t *data);
 
-		} else if(((command ^ SET_ALL_LED) & 0xF0) == 0){
-			for(uint8_t i = 0; i < 16; i++){
-				uint8_t value = Wire.read();
-				ml_setColor(i, value);				
-			}
+struct mw_opcode{
+	uint8_t length;
+	mw_receiveFunction receive;
+	mw_executeFunction execute;
+};
+
+mw_receiveFunction _mw_rxFunction;
+
+// Start a color stream, to the stage frame or to the fade targets.
+void mw_startStream(uint8_t led, bool stage){
+	_mw_rxChannel = 0;
+	_mw_rxLed = led;
+	_mw_rxStage = stage;
+}
+
+// Write a streamed color byte.
+// The stage frame may be swapped between two bytes, so the led is staged and looked up each time.
+void mw_streamByte(uint8_t data){
+	uint8_t *color = _mf_next[_mw_rxLed];
+	if(_mw_rxStage){
+		ml_stageLed(_mw_rxLed);
+		color = _ml_ledStage[_mw_rxLed];
+	}
+	color[_mw_channelOffset[_mw_rxChannel]] = data;
+	if(++_mw_rxChannel == 3){
+		_mw_rxChannel = 0;
+		_mw_rxLed++;
+	}
+}
+
+// Commands which data are used once complete. They are queued with their data.
+void mw_receiveQueued(uint8_t command, uint8_t index, uint8_t data){
+	if(index > 0){
+		_mw_rxData[index - 1] = data;
+	}
+	if(index == _mw_rxLength){
+		mw_pushCommand(command);
+	}
+}
+
+void mw_receiveOneLed(uint8_t command, uint8_t index, uint8_t data){
+	uint8_t ledId = command & 0x0F;
+
+	if(index == 0){
+		mw_startStream(ledId, true);
+	} else if(_mw_colorMode == COLOR_MODE_24){
+		mw_streamByte(data);
+	} else if(_mw_colorMode == COLOR_MODE_PALETTE){
+		ml_stageColorIndex(ledId, data);
+	} else {
+		ml_stageColor(ledId, data);
+	}
+}
+
+// The global color is staged once complete, as a fill: leds take it when latched, not one by one in the interrupt.
+void mw_receiveGlobalLed(uint8_t, uint8_t index, uint8_t data){
+	if(index == 0){
+		return;
+	}
+
+	if(_mw_colorMode == COLOR_MODE_24){
+		_mw_rxData[index - 1] = data;
+		if(index == _mw_rxLength){
+			ml_stageFill(_mw_rxData[0], _mw_rxData[1], _mw_rxData[2]);
 		}
 
-	} else if (_mw_colorMode == COLOR_MODE_24){
-		if(((command ^ SET_ONE_LED) & 0xF0) == 0){
-			uint8_t rValue = Wire.read();
-			uint8_t gValue = Wire.read();
-			uint8_t bValue = Wire.read();
-			ml_setColor(command & 0x0F, rValue, gValue, bValue);
-
-		} else if(((command ^ SET_GLOBAL_LED) & 0xF0) == 0){
-			uint8_t rValue = Wire.read();
-			uint8_t gValue = Wire.read();
-			uint8_t bValue = Wire.read();
-			for(uint8_t i = 0; i < 16; i++){
-				ml_setColor(i, rValue, gValue, bValue);				
-			}
+	} else if(_mw_colorMode == COLOR_MODE_PALETTE){
+		ml_stageFillIndex(data);
 
-		} else if(((command ^ SET_ALL_LED) & 0xF0) == 0){
-			for(uint8_t i = 0; i < 16; i++){
-				uint8_t rValue = Wire.read();
-				uint8_t gValue = Wire.read();
-				uint8_t bValue = Wire.read();
-				ml_setColor(i, rValue, gValue, bValue);				
+	} else {
+		uint32_t rgb = ml_convertColor(data);
+		ml_stageFill((uint8_t)(rgb >> 16), (uint8_t)(rgb >> 8), (uint8_t)rgb);
+	}
+}
+
+void mw_receiveAllLed(uint8_t, uint8_t index, uint8_t data){
+	if(index == 0){
+		mw_startStream(0, true);
+	} else if(_mw_colorMode == COLOR_MODE_24){
+		mw_streamByte(data);
+	} else if(_mw_colorMode == COLOR_MODE_PALETTE){
+		ml_stageColorIndex(2 * (index - 1), data >> 4);
+		ml_stageColorIndex(2 * (index - 1) + 1, data);
+	} else {
+		ml_stageColor(index - 1, data);
+	}
+}
+
+// Fade targets come after easing and duration. Fades are queued once all their targets are received.
+void mw_receiveFadeOne(uint8_t command, uint8_t index, uint8_t data){
+	uint8_t ledId = command & 0x0F;
+
+	if(index == 0){
+		mw_startStream(ledId, false);
+	} else if(index <= 3){
+		_mw_rxData[index - 1] = data;
+	} else if(_mw_colorMode == COLOR_MODE_24){
+		mw_streamByte(data);
+	} else {
+		mw_setFadeTarget(ledId, data);
+	}
+
+	if(index == _mw_rxLength){
+		mw_pushCommand(command);
+	}
+}
+
+void mw_receiveFadeAll(uint8_t command, uint8_t index, uint8_t data){
+	if(index == 0){
+		mw_startStream(0, false);
+	} else if(index <= 3){
+		_mw_rxData[index - 1] = data;
+	} else if(_mw_colorMode == COLOR_MODE_24){
+		mw_streamByte(data);
+	} else if(_mw_colorMode == COLOR_MODE_PALETTE){
+		mw_setFadeTarget(2 * (index - 4), data >> 4);
+		mw_setFadeTarget(2 * (index - 4) + 1, data & 0x0F);
+	} else {
+		mw_setFadeTarget(index - 4, data);
+	}
+
+	if(index == _mw_rxLength){
+		mw_pushCommand(command);
+	}
+}
+
+// Skip to the next led of a delta frame.
+void mw_nextDeltaLed(){
+	while((_mw_rxLed < MW_MAP_LEDS) && !(_mw_rxMask & _BV(_mw_rxLed))){
+		_mw_rxLed++;
+	}
+}
+
+// Delta frame: a mask of the leds sent, msb first, then the colors of these leds only, in the led order.
+// In palette mode two leds share a byte, like SET_ALL_LED. Leds not in the mask keep their color.
+void mw_receiveDeltaLed(uint8_t, uint8_t index, uint8_t data){
+	if(index == 0){
+		_mw_rxLength = 2;
+		return;
+	}
+
+	if(index == 1){
+		_mw_rxMask = (uint16_t)data << 8;
+		return;
+	}
+
+	if(index == 2){
+		_mw_rxMask |= data;
+
+		uint8_t count = 0;
+		for(uint16_t mask = _mw_rxMask; mask; mask >>= 1){
+			count += mask & 0x01;
+		}
+		if(_mw_colorMode == COLOR_MODE_24){
+			count *= 3;
+		} else if(_mw_colorMode == COLOR_MODE_PALETTE){
+			count = (count + 1) / 2;
+		}
+		_mw_rxLength = 2 + count;
+
+		mw_startStream(0, true);
+		mw_nextDeltaLed();
+		return;
+	}
+
+	if(_mw_colorMode == COLOR_MODE_24){
+		mw_streamByte(data);
+	} else if(_mw_colorMode == COLOR_MODE_PALETTE){
+		ml_stageColorIndex(_mw_rxLed++, data >> 4);
+		mw_nextDeltaLed();
+		if(_mw_rxLed < MW_MAP_LEDS){
+			ml_stageColorIndex(_mw_rxLed++, data);
+		}
+	} else {
+		ml_stageColor(_mw_rxLed++, data);
+	}
+	mw_nextDeltaLed();
+}
+
+// Palette colors, 3 bytes each, from the index given with the command. They are shown on next latch.
+void mw_receivePalette(uint8_t command, uint8_t index, uint8_t data){
+	if(index == 0){
+		mw_startStream(0, false);
+		return;
+	}
+
+	if(_mw_rxChannel == 0){
+		_mw_rxData[0] = data;
+	} else if(_mw_rxChannel == 1){
+		_mw_rxData[1] = data;
+	} else {
+		ml_setPalette((command & 0x0F) + _mw_rxLed, _mw_rxData[0], _mw_rxData[1], data);
+		_mw_rxLed++;
+	}
+	if(++_mw_rxChannel == 3){
+		_mw_rxChannel = 0;
+	}
+}
+
+// Register address, then register values.
+void mw_receiveRegister(uint8_t, uint8_t index, uint8_t data){
+	if(index == 0){
+		_mw_twiState = TWI_SEND_REGISTER;
+	} else if(index == 1){
+		_mw_regAddress = data;
+	} else {
+		mw_writeRegister(_mw_regAddress++, data);
+	}
+}
+
+// The color mode is needed to decode the next commands, so it's not queued.
+void mw_receiveColorMode(uint8_t command, uint8_t, uint8_t){
+	if((command & 0x03) <= COLOR_MODE_PALETTE){
+		_mw_colorMode = (command & 0x03);
+	}
+}
+
+// Requests set what will be sent on the next read.
+void mw_receiveGetButtons(uint8_t, uint8_t, uint8_t){
+	_mw_twiState = TWI_SEND_BUTTONS;
+}
+
+void mw_receiveGetEvents(uint8_t command, uint8_t, uint8_t){
+	_mw_twiState = TWI_SEND_EVENTS;
+	_mw_maxEvents = command & 0x0F;
+	if(_mw_maxEvents == 0){
+		_mw_maxEvents = MAX_EVENTS;
+	}
+}
+
+void mw_receiveGetQueue(uint8_t, uint8_t, uint8_t){
+	_mw_twiState = TWI_SEND_QUEUE;
+}
+
+void mw_receiveGetRefresh(uint8_t, uint8_t, uint8_t){
+	_mw_twiState = TWI_SEND_REFRESH;
+}
+
+// Frame output: the frame is latched once the command is complete, and its output flagged.
+void mw_receiveOutput(uint8_t command, uint8_t index, uint8_t data){
+	if(index < _mw_rxLength){
+		return;
+	}
+
+	ml_latch();
+
+	if(command == LATCH){
+		_mw_latchSequence = data;
+		_mw_output |= OUTPUT_UPDATE;
+	} else if(command == REFRESH_LEDS){
+		_mw_output |= OUTPUT_REFRESH;
+	} else {
+		_mw_output |= OUTPUT_UPDATE;
+	}
+}
+
+void mw_receiveGetLatch(uint8_t, uint8_t, uint8_t){
+	_mw_twiState = TWI_SEND_LATCH;
+}
+
+void mw_receiveGetStats(uint8_t, uint8_t, uint8_t){
+	_mw_twiState = TWI_SEND_STATS;
+}
+
+void mw_receiveGetTasks(uint8_t, uint8_t, uint8_t){
+	_mw_twiState = TWI_SEND_TASKS;
+}
+
+// The next read tells if key events are waiting.
+void mw_receiveHasChanged(uint8_t, uint8_t, uint8_t){
+	_mw_twiState = TWI_SEND_CHANGED;
+}
+
+// Execute functions.
+void mw_executeFadeOne(uint8_t command, const uint8_t *data){
+	mf_start(command & 0x0F, ((uint16_t)data[1] << 8) | data[2], data[0]);
+}
+
+void mw_executeFadeAll(uint8_t, const uint8_t *data){
+	for(uint8_t i = 0; i < NUM_LED; i++){
+		mf_start(i, ((uint16_t)data[1] << 8) | data[2], data[0]);
+	}
+}
+
+void mw_executeLedState(uint8_t, const uint8_t *data){
+	ml_setLed((uint16_t)(((uint16_t)data[0] << 8) | data[1]));
+}
+
+void mw_executeBrightness(uint8_t, const uint8_t *data){
+	ml_setBrightness(data[0]);
+}
+
+void mw_executeDisplayState(uint8_t command, const uint8_t *){
+	ml_setDisplayState((bool)(command & 0x01));
+}
+
+void mw_executeBlinkState(uint8_t command, const uint8_t *){
+	ml_setBlinkState((bool)(command & 0x01));
+}
+
+void mw_executeBlinkMask(uint8_t, const uint8_t *data){
+	ml_setBlinkMask((uint16_t)(((uint16_t)data[0] << 8) | data[1]));
+}
+
+void mw_executeBlinkOnDelay(uint8_t, const uint8_t *data){
+	ml_setBlinkOnDelay(((uint16_t)data[0] << 8) | data[1]);
+}
+
+void mw_executeBlinkOffDelay(uint8_t, const uint8_t *data){
+	ml_setBlinkOffDelay(((uint16_t)data[0] << 8) | data[1]);
+}
+
+void mw_executeDebounceDelay(uint8_t, const uint8_t *data){
+	mp_setDebounceDelay(data[0]);
+}
+
+void mw_executeSetRule(uint8_t command, const uint8_t *data){
+	mr_setRule(command & 0x0F, data[0], data[1]);
+}
+
+void mw_executeGestures(uint8_t, const uint8_t *data){
+	mg_setGestures(data[0]);
+}
+
+void mw_executeLongTime(uint8_t, const uint8_t *data){
+	mg_setLongTime(((uint16_t)data[0] << 8) | data[1]);
+}
+
+void mw_executeDoubleTime(uint8_t, const uint8_t *data){
+	mg_setDoubleTime(((uint16_t)data[0] << 8) | data[1]);
+}
+
+void mw_executeRepeatDelay(uint8_t, const uint8_t *data){
+	mg_setRepeatDelay(((uint16_t)data[0] << 8) | data[1]);
+}
+
+void mw_executeRepeatPeriod(uint8_t, const uint8_t *data){
+	mg_setRepeatPeriod(((uint16_t)data[0] << 8) | data[1]);
+}
+
+void mw_executeClrDisplay(uint8_t, const uint8_t *){
+	ml_clrLeds();
+}
+
+void mw_executeResetStats(uint8_t, const uint8_t *){
+	ms_reset();
+	mk_resetStats();
+}
+
+void mw_executeReset(uint8_t, const uint8_t *){
+	//reset boad
+}
+
+// Opcode table, indexed by the command byte, in flash.
+// Commands which low nibble is a parameter fill their 16 entries.
+// Unknown commands have no functions, and take the rest of the write, so it is ignored.
+// The dispatch cost of each command is measured by the twi bench path, per command.
+#define MW_OP(length, receive, execute) {length, receive, execute}
+#define MW_OP16(length, receive, execute) \
+	MW_OP(length, receive, execute), MW_OP(length, receive, execute), \
+	MW_OP(length, receive, execute), MW_OP(length, receive, execute), \
+	MW_OP(length, receive, execute), MW_OP(length, receive, execute), \
+	MW_OP(length, receive, execute), MW_OP(length, receive, execute), \
+	MW_OP(length, receive, execute), MW_OP(length, receive, execute), \
+	MW_OP(length, receive, execute), MW_OP(length, receive, execute), \
+	MW_OP(length, receive, execute), MW_OP(length, receive, execute), \
+	MW_OP(length, receive, execute), MW_OP(length, receive, execute)
+#define MW_UNKNOWN MW_OP(LEN_STREAM, NULL, NULL)
+
+const mw_opcode _mw_opcodes[256] PROGMEM = {
+	// 0x00 SET_ONE_LED
+	MW_OP16(LEN_COLOR, mw_receiveOneLed, NULL),
+	// 0x10 SET_GLOBAL_LED
+	MW_OP16(LEN_COLOR, mw_receiveGlobalLed, NULL),
+	// 0x20 SET_ALL_LED
+	MW_OP16(LEN_FRAME, mw_receiveAllLed, NULL),
+	// 0x30 SET_DELTA_LED
+	MW_OP(2, mw_receiveDeltaLed, NULL),
+	MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN,
+	MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN,
+	// 0x40 GET_BUTTONS
+	MW_OP16(0, mw_receiveGetButtons, NULL),
+	// 0x50 LED_STATE
+	MW_OP(2, mw_receiveQueued, mw_executeLedState),
+	MW_OP(1, mw_receiveQueued, mw_executeBrightness),		// BRIGHTNESS
+	MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN,
+	MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN,
+	// 0x60 DISPLAY_STATE
+	MW_OP16(0, mw_receiveQueued, mw_executeDisplayState),
+	// 0x70 BLINK_STATE
+	MW_OP16(0, mw_receiveQueued, mw_executeBlinkState),
+	// 0x80 system registers
+	MW_OP(2, mw_receiveQueued, mw_executeBlinkOnDelay),		// BLINK_ON_DELAY
+	MW_OP(2, mw_receiveQueued, mw_executeBlinkOffDelay),	// BLINK_OFF_DELAY
+	MW_OP(1, mw_receiveQueued, mw_executeDebounceDelay),	// DEBOUNCE_DELAY
+	MW_OP(0, mw_receiveHasChanged, NULL),					// HAS_CHANGED
+	MW_OP(0, mw_receiveColorMode, NULL),					// COLOR_MODE
+	MW_OP(0, mw_receiveColorMode, NULL),
+	MW_OP(0, mw_receiveColorMode, NULL),
+	MW_OP(0, mw_receiveColorMode, NULL),
+	MW_OP(0, mw_receiveGetQueue, NULL),						// GET_QUEUE
+	MW_OP(0, mw_receiveGetRefresh, NULL),					// GET_REFRESH
+	MW_OP(2, mw_receiveQueued, mw_executeBlinkMask),		// BLINK_MASK
+	MW_OP(1, mw_receiveOutput, NULL),						// LATCH
+	MW_OP(0, mw_receiveGetLatch, NULL),						// GET_LATCH
+	MW_OP(0, mw_receiveGetStats, NULL),						// GET_STATS
+	MW_OP(0, mw_receiveQueued, mw_executeResetStats),		// RESET_STATS
+	MW_OP(0, mw_receiveGetTasks, NULL),						// GET_TASKS
+	// 0x90 GET_EVENTS
+	MW_OP16(0, mw_receiveGetEvents, NULL),
+	// 0xA0 FADE_ONE_LED
+	MW_OP16(LEN_FADE_ONE, mw_receiveFadeOne, mw_executeFadeOne),
+	// 0xB0 FADE_ALL_LED
+	MW_OP16(LEN_FADE_ALL, mw_receiveFadeAll, mw_executeFadeAll),
+	// 0xC0 SET_PALETTE
+	MW_OP16(LEN_STREAM, mw_receivePalette, NULL),
+	// 0xD0 SET_RULE
+	MW_OP16(2, mw_receiveQueued, mw_executeSetRule),
+	// 0xE0 REGISTER
+	MW_OP(LEN_STREAM, mw_receiveRegister, NULL),
+	MW_OP(1, mw_receiveQueued, mw_executeGestures),			// GESTURES
+	MW_OP(2, mw_receiveQueued, mw_executeLongTime),			// LONG_TIME
+	MW_OP(2, mw_receiveQueued, mw_executeDoubleTime),		// DOUBLE_TIME
+	MW_OP(2, mw_receiveQueued, mw_executeRepeatDelay),		// REPEAT_DELAY
+	MW_OP(2, mw_receiveQueued, mw_executeRepeatPeriod),		// REPEAT_PERIOD
+	MW_UNKNOWN, MW_UNKNOWN,
+	MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN,
+	// 0xF0 control
+	MW_OP(0, mw_receiveQueued, mw_executeClrDisplay),		// CLR_DISPLAY
+	MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN,
+	MW_OP(0, mw_receiveOutput, NULL),						// UPDATE_LEDS
+	MW_OP(0, mw_receiveOutput, NULL),						// REFRESH_LEDS
+	MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN, MW_UNKNOWN,
+	MW_OP(0, mw_receiveQueued, mw_executeReset),			// RESET
+};
+
+// Receive handler, called for each byte of a write.
+// The first byte is a command, looked up in the opcode table, the followings are its data, used as they arrive.
+// Once the command has all its data, the next byte is a new command.
+void mw_receiveHandler(uint8_t data){
+	if(_mw_rxCount == 0){
+		const mw_opcode *opcode = &_mw_opcodes[data];
+		uint8_t length = pgm_read_byte(&opcode->length);
+		if((length >= LEN_COLOR) && (length < LEN_STREAM)){
+			length = _mw_colorLength[_mw_colorMode][length - LEN_COLOR];
+		}
+		_mw_command = data;
+		_mw_rxLength = length;
+		_mw_rxFunction = (mw_receiveFunction)pgm_read_ptr(&opcode->receive);
+		ml_markStage(&_mw_rxMark);
+		if(_mw_rxFunction == NULL){
+			ms_malformed();
+		}
+	}
+
+	if(_mw_rxFunction != NULL){
+		_mw_rxFunction(_mw_command, _mw_rxCount, data);
+	}
+
+	// Stream commands never reach their length, the count stops below it.
+	if(_mw_rxCount == _mw_rxLength){
+		_mw_rxCount = 0;
+	} else if(_mw_rxCount < LEN_STREAM - 1){
+		_mw_rxCount++;
+	}
+}
+
+// Stop handler, called at the end of a write. An incomplete command is dropped, with the leds it staged.
+void mw_stopHandler(){
+	if((_mw_rxCount != 0) && (_mw_rxLength != LEN_STREAM)){
+		ml_dropStage(&_mw_rxMark);
+		ms_malformed();
+	}
+	_mw_rxCount = 0;
+}
+
+// Write a register. Settings are queued like their commands.
+void mw_writeRegister(uint8_t address, uint8_t data){
+	if(address < REG_COLOR + 3 * MW_MAP_LEDS){
+		uint8_t led = (address - REG_COLOR) / 3;
+		uint8_t channel = (address - REG_COLOR) % 3;
+		ml_stageLed(led);
+		_ml_ledStage[led][_mw_channelOffset[channel]] = data;
+		return;
+	}
+
+	if((address >= REG_PALETTE) && (address < REG_PALETTE + 3 * ML_PALETTE_SIZE)){
+		uint8_t color = (address - REG_PALETTE) / 3;
+		uint8_t channel = (address - REG_PALETTE) % 3;
+		uint32_t rgb = ml_getPalette(color);
+		uint8_t rChannel = (channel == 0) ? data : (uint8_t)(rgb >> 16);
+		uint8_t gChannel = (channel == 1) ? data : (uint8_t)(rgb >> 8);
+		uint8_t bChannel = (channel == 2) ? data : (uint8_t)rgb;
+		ml_setPalette(color, rChannel, gChannel, bChannel);
+		return;
+	}
+
+	// Msb of 16 bits registers are kept until the lsb is written.
+	_mw_rxData[0] = _mw_regLatch;
+	_mw_rxData[1] = data;
+
+	switch(address){
+		case REG_LED_STATE + 1:
+			mw_pushCommand(LED_STATE);
+			break;
+		case REG_DISPLAY_STATE:
+			mw_pushCommand(DISPLAY_STATE | (data & 0x01));
+			break;
+		case REG_BLINK_STATE:
+			mw_pushCommand(BLINK_STATE | (data & 0x01));
+			break;
+		case REG_BLINK_ON + 1:
+			mw_pushCommand(BLINK_ON_DELAY);
+			break;
+		case REG_BLINK_OFF + 1:
+			mw_pushCommand(BLINK_OFF_DELAY);
+			break;
+		case REG_BLINK_MASK + 1:
+			mw_pushCommand(BLINK_MASK);
+			break;
+		case REG_DEBOUNCE:
+			_mw_rxData[0] = data;
+			mw_pushCommand(DEBOUNCE_DELAY);
+			break;
+		case REG_BRIGHTNESS:
+			_mw_rxData[0] = data;
+			mw_pushCommand(BRIGHTNESS);
+			break;
+		case REG_COLOR_MODE:
+			if(data <= COLOR_MODE_PALETTE){
+				_mw_colorMode = data;
 			}
+			break;
+		default:
+			break;
+	}
+
+	_mw_regLatch = data;
+}
+
+// Read a register. Unknown addresses read as 0.
+uint8_t mw_readRegister(uint8_t address){
+	if(address < REG_COLOR + 3 * MW_MAP_LEDS){
+		uint8_t led = (address - REG_COLOR) / 3;
+		uint8_t channel = (address - REG_COLOR) % 3;
+		return _ml_ledColor[led][_mw_channelOffset[channel]];
+	}
+
+	if((address >= REG_PALETTE) && (address < REG_PALETTE + 3 * ML_PALETTE_SIZE)){
+		uint8_t color = (address - REG_PALETTE) / 3;
+		uint8_t channel = (address - REG_PALETTE) % 3;
+		return (uint8_t)(ml_getPalette(color) >> (8 * (2 - channel)));
+	}
+
+	uint16_t value = 0;
+
+	switch(address){
+		case REG_DISPLAY_STATE:
+			return ml_getDisplayState();
+		case REG_BLINK_STATE:
+			return ml_getBlinkState();
+		case REG_DEBOUNCE:
+			return mp_getDebounceDelay();
+		case REG_COLOR_MODE:
+			return _mw_colorMode;
+		case REG_BRIGHTNESS:
+			return ml_getBrightness();
+		case REG_EVENT_COUNT:
+			return mp_getEventCount();
+		case REG_QUEUE_HIGH:
+			return _mw_queueHighWater;
+		case REG_QUEUE_OVERFLOW:
+			return _mw_queueOverflow;
+		case REG_LATCH:
+			return _mw_latchSequence;
+
+		// Lsb of 16 bits registers, as latched when the msb was read.
+		case REG_LED_STATE + 1:
+		case REG_BLINK_ON + 1:
+		case REG_BLINK_OFF + 1:
+		case REG_BLINK_MASK + 1:
+		case REG_BUTTONS + 1:
+		case REG_REFRESH_COUNT + 1:
+		case REG_SKIP_COUNT + 1:
+			return _mw_regLatch;
+
+		case REG_LED_STATE:
+			value = ml_getLed();
+			break;
+		case REG_BLINK_ON:
+			value = ml_getBlinkOnDelay();
+			break;
+		case REG_BLINK_OFF:
+			value = ml_getBlinkOffDelay();
+			break;
+		case REG_BLINK_MASK:
+			value = ml_getBlinkMask();
+			break;
+		case REG_BUTTONS:
+			value = mp_getButtons();
+			break;
+		case REG_REFRESH_COUNT:
+			value = ml_getRefreshCount();
+			break;
+		case REG_SKIP_COUNT:
+			value = ml_getSkipCount();
+			break;
+		default:
+			return 0;
+	}
+
+	_mw_regLatch = (uint8_t)(value & 0xFF);
+	return (uint8_t)(value >> 8);
+}
+
+// Set a fade target from a 8 bits color, or a palette index in palette mode.
+void mw_setFadeTarget(uint8_t ledId, uint8_t color){
+	uint32_t rgb;
+	if(_mw_colorMode == COLOR_MODE_PALETTE){
+		rgb = ml_getPalette(color);
+	} else {
+		rgb = ml_convertColor(color);
+	}
+	mf_setTarget(ledId, (uint8_t)(rgb >> 16), (uint8_t)(rgb >> 8), (uint8_t)rgb);
+}
+
+// Queue a command, with the data received so far. When the queue is full the command is dropped and counted.
+void mw_pushCommand(uint8_t command){
+	uint8_t head = _mw_queueHead;
+	uint8_t next = (head + 1) & (QUEUE_SIZE - 1);
+
+	if(next == _mw_queueTail){
+		if(_mw_queueOverflow < 0xFF){
+			_mw_queueOverflow++;
 		}
+		ms_queueOverflow();
+		return;
+	}
+
+	_mw_queue[head].command = command;
+	_mw_queue[head].data[0] = _mw_rxData[0];
+	_mw_queue[head].data[1] = _mw_rxData[1];
+	_mw_queue[head].data[2] = _mw_rxData[2];
+
+	// The entry is complete before to be published.
+	_mw_queueHead = next;
+
+	uint8_t count = (next - _mw_queueTail) & (QUEUE_SIZE - 1);
+	if(count > _mw_queueHighWater){
+		_mw_queueHighWater = count;
 	}
+}
+
+// Execute the queued commands, then send the frame if one was requested. To be called from the loop.
+// The output request is taken first: the commands received before it are then all in the queue.
+void mw_update(){
+	uint8_t sreg = SREG;
+	cli();
+	uint8_t output = _mw_output;
+	_mw_output = 0;
+	SREG = sreg;
 
-	if(((command ^ GET_BUTTONS) & 0xF0) == 0){
-	 	_mw_twiState = TWI_SEND_BUTTONS;
-
-	} else if((command ^ LED_STATE) == 0){
-		uint16_t data = ((uint16_t)Wire.read() << 8);
-		data |= Wire.read();
-		ml_setLed(data);
-
-	} else if(((command ^ DISPLAY_STATE) & 0xF0) == 0){
-		ml_setDisplayState((bool)(command & 0x01));
-
-	} else if(((command ^ BLINK_STATE) & 0xF0) == 0){
-		ml_setBlinkState((bool)(command & 0x01));
-
-	} else if((command ^ BLINK_ON_DELAY) == 0){
-		uint16_t delay = 0;
-		delay |= ((uint16_t)Wire.read() << 8);
-		delay |= (Wire.read());
-		ml_setBlinkOnDelay(delay);
-
-	} else if((command ^ BLINK_OFF_DELAY) == 0){
-		uint16_t delay = 0;
-		delay |= ((uint16_t)Wire.read() << 8);
-		delay |= (Wire.read());
-		ml_setBlinkOffDelay(delay);
-		
-	} else if((command ^ DEBOUNCE_DELAY) == 0){
-		uint8_t delay = Wire.read();
-		mp_setDebounceDelay(delay);
-
-	} else if((command ^ HAS_CHANGED) == 0){
-		_mw_twiState = TWI_SEND_INT;
-
-		// TODO: see if it work like that, or if it will have to be changed.
-	} else if(((command ^ COLOR_MODE) & 0xFE) == 0){
-		_mw_colorMode = (command & 0x01);
-	} else if((command ^ CLR_DISPLAY) == 0){
-		ml_clrLeds();
-	} else if((command ^ UPDATE_LEDS) == 0){
+	while(_mw_queueTail != _mw_queueHead){
+		uint8_t tail = _mw_queueTail;
+		uint8_t command = _mw_queue[tail].command;
+		mw_executeFunction execute = (mw_executeFunction)pgm_read_ptr(&_mw_opcodes[command].execute);
+		if(execute != NULL){
+			execute(command, _mw_queue[tail].data);
+		}
+		_mw_queueTail = (tail + 1) & (QUEUE_SIZE - 1);
+	}
+
+	if(!output){
+		return;
+	}
+
+	if(output & OUTPUT_REFRESH){
+		ml_refresh();
+	} else {
 		ml_update();
-	} else if((command ^ RESET) == 0){
-		//reset boad
 	}
+}
+
+//Tell if a frame is waiting to be sent.
+bool mw_isOutputPending(){
+	return _mw_output != 0;
+}
 
+//Get the max number of commands that have been waiting in the queue.
+uint8_t mw_getQueueHighWater(){
+	return _mw_queueHighWater;
 }
 
-// Request handler.
-void mw_requestHandler(){
+//Get the number of commands dropped because the queue was full.
+uint8_t mw_getQueueOverflow(){
+	return _mw_queueOverflow;
+}
+
+// Request handler, called for each byte to send. When there is nothing more to send, 0xFF is sent.
+uint8_t mw_requestHandler(){
+	uint8_t data = 0xFF;
 
-	uint16_t buttons = 0;
 	switch (_mw_twiState){
 		case TWI_SEND_BUTTONS:
-			// Get a reading from buttons
-			buttons = mp_getButtons();
-			// Wire implementation causes only one write() can be made per request,
-			// so a buffer is set to send both bytes (int16 cut in two) at once. 
-			uint8_t but[2];
-			but[0] = (uint8_t)(buttons >> 8);
-			but[1] = (uint8_t)(buttons & 0xFF);
-			Wire.write(but, 2);
-			_mw_twiState = TWI_SEND_IDLE;
+			// Get a reading from buttons on the first byte, so both bytes are from the same reading.
+			if(_mw_txCount == 0){
+				_mw_txButtons = mp_getButtons();
+				data = (uint8_t)(_mw_txButtons >> 8);
+			} else if(_mw_txCount == 1){
+				data = (uint8_t)(_mw_txButtons & 0xFF);
+			}
 			break;
-/*		case TWI_SEND_INT:
-			Wire.write(_mp_int);
-			_mp_int = false;
-			_mw_twiState = TWI_SEND_IDLE;
+		case TWI_SEND_QUEUE:
+			if(_mw_txCount == 0){
+				data = _mw_queueHighWater;
+			} else if(_mw_txCount == 1){
+				data = _mw_queueOverflow;
+			}
 			break;
-*/		default:
+		case TWI_SEND_REFRESH:
+			// Both counters are read on the first byte, so they are consistent.
+			if(_mw_txCount == 0){
+				_mw_txRefresh = ml_getRefreshCount();
+				_mw_txSkip = ml_getSkipCount();
+				data = (uint8_t)(_mw_txRefresh >> 8);
+			} else if(_mw_txCount == 1){
+				data = (uint8_t)(_mw_txRefresh & 0xFF);
+			} else if(_mw_txCount == 2){
+				data = (uint8_t)(_mw_txSkip >> 8);
+			} else if(_mw_txCount == 3){
+				data = (uint8_t)(_mw_txSkip & 0xFF);
+			}
 			break;
+		case TWI_SEND_STATS:
+			// The block is taken on the first byte, so all counters are from the same time.
+			if(_mw_txCount == 0){
+				ms_getStatus(_mw_txStats);
+			}
+			if(_mw_txCount < MS_STATUS_SIZE){
+				data = _mw_txStats[_mw_txCount];
+			}
+			break;
+		case TWI_SEND_TASKS:
+			// Idle ratio in per thousand, then max run time in us and deadlines missed of each task.
+			if(_mw_txCount == 0){
+				_mw_txValue = mk_getIdle();
+			} else if(_mw_txCount < 2 + 4 * MK_NUM_TASKS){
+				uint8_t task = (_mw_txCount - 2) / 4;
+				uint8_t index = (_mw_txCount - 2) % 4;
+				if(index == 0){
+					_mw_txValue = mk_getMaxTime(task);
+				} else if(index == 2){
+					_mw_txValue = mk_getMisses(task);
+				}
+			}
+			if(_mw_txCount < 2 + 4 * MK_NUM_TASKS){
+				data = (_mw_txCount & 0x01) ? (uint8_t)(_mw_txValue & 0xFF) : (uint8_t)(_mw_txValue >> 8);
+			}
+			break;
+		case TWI_SEND_LATCH:
+			if(_mw_txCount == 0){
+				data = _mw_latchSequence;
+			}
+			break;
+		case TWI_SEND_REGISTER:
+			if(_mw_regAddress < REG_END){
+				data = mw_readRegister(_mw_regAddress++);
+			}
+			break;
+		case TWI_SEND_EVENTS:
+			// Events are sent as a header with the number of events and the number of events lost,
+			// followed by type, key and timestamp (msb first) of each event, oldest first.
+			// An event is removed from the buffer when its first byte is sent.
+			if(_mw_txCount == 0){
+				_mw_txEvents = mp_getEventCount();
+				if(_mw_txEvents > _mw_maxEvents){
+					_mw_txEvents = _mw_maxEvents;
+				}
+				data = _mw_txEvents;
+			} else if(_mw_txCount == 1){
+				data = mp_getEventOverflow();
+			} else if(_mw_txEvents > 0){
+				uint8_t index = (_mw_txCount - 2) & 0x03;
+				if(index == 0){
+					mp_getEvent(&_mw_txEvent);
+					data = _mw_txEvent.type;
+				} else if(index == 1){
+					data = _mw_txEvent.key;
+				} else if(index == 2){
+					data = (uint8_t)(_mw_txEvent.time >> 8);
+				} else {
+					data = (uint8_t)(_mw_txEvent.time & 0xFF);
+					_mw_txEvents--;
+				}
+			}
+			break;
+		case TWI_SEND_CHANGED:
+			if(_mw_txCount == 0){
+				data = (mp_getEventCount() > 0) ? 1 : 0;
+			}
+			break;
+		default:
+			break;
+	}
+
+	if(_mw_txCount < 0xFF){
+		_mw_txCount++;
 	}
 
-}
\ No newline at end of file
+	return data;
+}
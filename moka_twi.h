@@ -21,12 +21,23 @@
 #ifndef MOKA_TWI_H
 #define MOKA_TWI_H
 
-#include <Arduino.h>
+#include "moka_hal.h"
 
 void mw_init();
 
-void mw_receiveHandler(int bytes);
-void mw_requestHandler();
+void mw_receiveHandler(uint8_t data);
+void mw_stopHandler();
+uint8_t mw_requestHandler();
+
+void mw_writeRegister(uint8_t address, uint8_t data);
+uint8_t mw_readRegister(uint8_t address);
+void mw_setFadeTarget(uint8_t ledId, uint8_t color);
+void mw_pushCommand(uint8_t command);
+void mw_update();
+bool mw_isOutputPending();
+
+uint8_t mw_getQueueHighWater();
+uint8_t mw_getQueueOverflow();
 
 
 #endif
@@ -0,0 +1,38 @@
+//Replay a TWI trace to the host build of the firmware, and print the report.
+//	moka_replay trace [address]
+// The board answers at the given address, 10 by default, as set by its jumpers. The exit code is 1 if the trace
+// isn't valid, the report then covers the transactions before the error.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Moka_Firmware.ino"
+#include "moka_trace.h"
+
+int main(int argc, char *argv[]){
+	if(argc < 2){
+		fprintf(stderr, "usage: %s trace [address]\n", argv[0]);
+		return 2;
+	}
+
+	FILE *file = fopen(argv[1], "rb");
+	if(file == NULL){
+		fprintf(stderr, "can't open %s\n", argv[1]);
+		return 2;
+	}
+
+	uint8_t address = (argc > 2) ? strtoul(argv[2], NULL, 0) : 10;
+	mh_hostReset();
+	mh_hostSetJumpers(address - 10);
+	setup();
+
+	mt_report report;
+	bool valid = mt_replay(file, loop, &report);
+	fclose(file);
+
+	mt_printReport(stdout, &report);
+	if(!valid){
+		fprintf(stderr, "%s: not a valid trace\n", argv[1]);
+	}
+	return valid ? 0 : 1;
+}
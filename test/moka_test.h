@@ -0,0 +1,97 @@
+//Host test helpers for the moka board
+
+/*
+ * This is a library for testing the moka board firmware on the host
+ * Copyright 2017 - Pierre-Loup Martin / le labo du troisième
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOKA_TEST_H
+#define MOKA_TEST_H
+
+// A test is a single source: it includes this file, which brings in the sketch for setup() and loop().
+// Firmware globals keep their state between cases, so a case starts from what the previous one left.
+// Checks print the failed condition and go on, the test returns non zero if any failed.
+
+#include <stdio.h>
+
+#include "Moka_Firmware.ino"
+#include "moka_stats.h"
+
+//Board address with no jumper closed.
+const uint8_t MU_ADDRESS = 10;
+
+//Leds reached by the TWI map, and by full frames.
+const uint8_t MU_LEDS = 16;
+
+//Time between two loops, in us.
+const uint16_t MU_LOOP_TIME = 50;
+
+uint16_t _mu_checks = 0;
+uint16_t _mu_failures = 0;
+
+#define MU_CHECK(condition) mu_check((condition), #condition, __FILE__, __LINE__)
+
+void mu_check(bool condition, const char *text, const char *file, int line){
+	_mu_checks++;
+	if(!condition){
+		_mu_failures++;
+		fprintf(stderr, "%s:%d: check failed: %s\n", file, line, text);
+	}
+}
+
+// Print the result of the test, and return its exit code.
+int mu_end(const char *name){
+	printf("%s: %u checks, %u failed\n", name, _mu_checks, _mu_failures);
+	return _mu_failures ? 1 : 0;
+}
+
+// Reset the emulated hardware and start the firmware.
+void mu_start(){
+	mh_hostReset();
+	setup();
+}
+
+// Let the time go on, running the loop every MU_LOOP_TIME.
+void mu_run(uint32_t time){
+	while(time > 0){
+		uint32_t step = (time < MU_LOOP_TIME) ? time : MU_LOOP_TIME;
+		mh_hostAdvance(step);
+		time -= step;
+		loop();
+	}
+}
+
+bool mu_write(const uint8_t *data, uint8_t length){
+	return mh_hostTwiWrite(MU_ADDRESS, data, length);
+}
+
+bool mu_read(uint8_t *data, uint8_t length){
+	return mh_hostTwiRead(MU_ADDRESS, data, length);
+}
+
+// Read the status block, see moka_stats.h.
+void mu_getStatus(uint8_t *status){
+	const uint8_t command = 0x8D;
+	mu_write(&command, 1);
+	mu_read(status, MS_STATUS_SIZE);
+}
+
+// Get a 16 bits value of the status block.
+uint16_t mu_getStatus16(const uint8_t *status, uint8_t index){
+	return ((uint16_t)status[2 * index] << 8) | status[2 * index + 1];
+}
+
+#endif
@@ -0,0 +1,168 @@
+//Delta frame test: bytes on the bus for a few changed leds, compared with full frames and single leds.
+
+#include "moka_test.h"
+
+const uint8_t MODE_8 = 0;
+const uint8_t MODE_24 = 1;
+const uint8_t MODE_PALETTE = 2;
+const char *_mu_modeNames[3] = {"8 bits", "24 bits", "palette"};
+
+const uint8_t METHOD_FULL = 0;
+const uint8_t METHOD_DELTA = 1;
+const uint8_t METHOD_ONE = 2;
+const char *_mu_methodNames[3] = {"full", "delta", "one"};
+
+const uint16_t FRAMES = 200;
+
+//Led colors as sent, 1 byte per led in 8 bits mode and palette mode, 3 in 24 bits mode.
+//Full frames carry all the leds of the build, changes are on the leds reached by the TWI map.
+uint8_t _mu_colors[NUM_LED][3];
+
+//Bytes on the bus, address included.
+uint32_t _mu_bytes = 0;
+
+uint32_t _mu_seed;
+
+uint8_t random8(){
+	_mu_seed = _mu_seed * 1103515245UL + 12345;
+	return (uint8_t)(_mu_seed >> 16);
+}
+
+void send(const uint8_t *data, uint8_t length){
+	MU_CHECK(mu_write(data, length));
+	_mu_bytes += length + 1;
+}
+
+uint8_t getColorSize(uint8_t mode){
+	return (mode == MODE_24) ? 3 : 1;
+}
+
+// Append the colors of the leds in the mask, in led order. Palette indexes go two per byte, msb first.
+uint8_t appendColors(uint8_t *data, uint8_t mode, ml_leds mask){
+	uint8_t length = 0;
+	bool half = false;
+	for(uint8_t i = 0; i < NUM_LED; i++){
+		if(!(mask & ML_LED(i))){
+			continue;
+		}
+		if(mode == MODE_PALETTE){
+			if(half){
+				data[length - 1] |= _mu_colors[i][0];
+			} else {
+				data[length++] = _mu_colors[i][0] << 4;
+			}
+			half = !half;
+		} else {
+			for(uint8_t j = 0; j < getColorSize(mode); j++){
+				data[length++] = _mu_colors[i][j];
+			}
+		}
+	}
+	return length;
+}
+
+// Send the changed leds and an update in one transaction, with the given method.
+void sendFrame(uint8_t mode, uint8_t method, uint16_t changed){
+	uint8_t data[2 + 3 * NUM_LED];
+	uint8_t length = 0;
+
+	if(method == METHOD_FULL){
+		data[length++] = 0x20;
+		length += appendColors(data + length, mode, ML_ALL_LEDS);
+	} else if(method == METHOD_DELTA){
+		data[length++] = 0x30;
+		data[length++] = (uint8_t)(changed >> 8);
+		data[length++] = (uint8_t)changed;
+		length += appendColors(data + length, mode, changed);
+	} else {
+		for(uint8_t i = 0; i < MU_LEDS; i++){
+			if(changed & (1 << i)){
+				data[length++] = 0x00 | i;
+				for(uint8_t j = 0; j < getColorSize(mode); j++){
+					data[length++] = _mu_colors[i][j];
+				}
+			}
+		}
+	}
+	data[length++] = 0xF5;
+
+	send(data, length);
+}
+
+// Run the same frames with a method: 2 to 5 random leds change each frame.
+// The frames sent to the leds are kept, and the bytes per frame returned, in tenths.
+uint32_t runFrames(uint8_t mode, uint8_t method, uint8_t (*frames)[3 * NUM_LED]){
+	memset(_mu_colors, 0, sizeof(_mu_colors));
+	const uint8_t colorMode = 0x84 | mode;
+	MU_CHECK(mu_write(&colorMode, 1));
+	sendFrame(mode, METHOD_FULL, 0xFFFF);
+	mu_run(20000);
+
+	_mu_seed = 1;
+	_mu_bytes = 0;
+	for(uint16_t n = 0; n < FRAMES; n++){
+		uint8_t count = 2 + random8() % 4;
+		uint16_t changed = 0;
+		while(count){
+			uint8_t led = random8() % MU_LEDS;
+			if(changed & (1 << led)){
+				continue;
+			}
+			changed |= 1 << led;
+			count--;
+			for(uint8_t j = 0; j < 3; j++){
+				_mu_colors[led][j] = (mode == MODE_PALETTE) ? (random8() & 0x0F) : random8();
+			}
+		}
+
+		uint32_t count0 = mh_hostGetFrameCount();
+		sendFrame(mode, method, changed);
+		mu_run(2000);
+		MU_CHECK(mh_hostGetFrameCount() == count0 + 1);
+		memcpy(frames[n], mh_hostGetFrame(), 3 * NUM_LED);
+	}
+
+	return _mu_bytes * 10 / FRAMES;
+}
+
+uint8_t _mu_frames[3][FRAMES][3 * NUM_LED];
+
+int main(){
+	mu_start();
+
+	const uint8_t ledState[] = {0x50, 0xFF, 0xFF};
+	MU_CHECK(mu_write(ledState, sizeof(ledState)));
+	uint8_t palette[1 + 3 * ML_PALETTE_SIZE] = {0xC0};
+	for(uint8_t i = 0; i < 3 * ML_PALETTE_SIZE; i++){
+		palette[1 + i] = i * 5;
+	}
+	MU_CHECK(mu_write(palette, sizeof(palette)));
+
+	uint8_t status[MS_STATUS_SIZE];
+	mu_getStatus(status);
+	uint8_t malformed = status[12];
+
+	printf("bytes per frame, 2 to 5 leds changed:\n");
+	for(uint8_t mode = MODE_8; mode <= MODE_PALETTE; mode++){
+		uint32_t bytes[3];
+		for(uint8_t method = METHOD_FULL; method <= METHOD_ONE; method++){
+			bytes[method] = runFrames(mode, method, _mu_frames[method]);
+		}
+		printf("%-8s", _mu_modeNames[mode]);
+		for(uint8_t method = METHOD_FULL; method <= METHOD_ONE; method++){
+			printf(" %s %lu.%lu", _mu_methodNames[method], (unsigned long)bytes[method] / 10, (unsigned long)bytes[method] % 10);
+		}
+		printf("\n");
+
+		// The leds show the same frames whatever the method, and the delta frames are the smallest.
+		MU_CHECK(memcmp(_mu_frames[METHOD_DELTA], _mu_frames[METHOD_FULL], sizeof(_mu_frames[0])) == 0);
+		MU_CHECK(memcmp(_mu_frames[METHOD_ONE], _mu_frames[METHOD_FULL], sizeof(_mu_frames[0])) == 0);
+		MU_CHECK(bytes[METHOD_DELTA] < bytes[METHOD_FULL]);
+		MU_CHECK(bytes[METHOD_DELTA] <= bytes[METHOD_ONE]);
+	}
+
+	mu_getStatus(status);
+	MU_CHECK(status[12] == malformed);
+
+	return mu_end("test_delta");
+}
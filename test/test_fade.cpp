@@ -0,0 +1,97 @@
+//Fade test: bytes on the bus for a fade run by the board, compared with the master sending each frame,
+//and targets of an incomplete fade command don't change the running fade.
+
+#include "moka_test.h"
+
+//Fade duration, in ms, and the master frame time for the same fade, in us.
+const uint16_t FADE_TIME = 500;
+const uint16_t FRAME_TIME = 20000;
+
+//Bytes on the bus, address included.
+uint32_t _mu_bytes = 0;
+
+void send(const uint8_t *data, uint8_t length){
+	MU_CHECK(mu_write(data, length));
+	_mu_bytes += length + 1;
+}
+
+// Check the last frame: all leds are the same value on all channels.
+bool isFrame(uint8_t value){
+	const uint8_t *frame = mh_hostGetFrame();
+	for(uint8_t i = 0; i < 3 * MU_LEDS; i++){
+		if(frame[i] != value){
+			return false;
+		}
+	}
+	return true;
+}
+
+// Set all leds to a value, at once.
+void setAll(uint8_t value){
+	uint8_t data[2 + 3 * MU_LEDS];
+	data[0] = 0x20;
+	memset(data + 1, value, 3 * MU_LEDS);
+	data[1 + 3 * MU_LEDS] = 0xF5;
+	MU_CHECK(mu_write(data, sizeof(data)));
+	mu_run(20000);
+}
+
+// Fade all leds to a value, linear, over FADE_TIME.
+void fadeAll(uint8_t value){
+	uint8_t data[4 + 3 * MU_LEDS];
+	data[0] = 0xB0;
+	data[1] = 0x00;
+	data[2] = (uint8_t)(FADE_TIME >> 8);
+	data[3] = (uint8_t)FADE_TIME;
+	memset(data + 4, value, 3 * MU_LEDS);
+	send(data, sizeof(data));
+}
+
+int main(){
+	mu_start();
+
+	const uint8_t setup24[] = {0x85, 0x50, 0xFF, 0xFF};
+	MU_CHECK(mu_write(setup24, sizeof(setup24)));
+
+	// The board fades from black to white with one command.
+	setAll(0);
+	uint32_t frames = mh_hostGetFrameCount();
+	_mu_bytes = 0;
+	fadeAll(255);
+	mu_run(FADE_TIME * 1000UL + 20000);
+	uint32_t fadeBytes = _mu_bytes;
+	uint32_t fadeFrames = mh_hostGetFrameCount() - frames;
+	MU_CHECK(isFrame(255));
+	MU_CHECK(fadeFrames >= FADE_TIME / MF_FRAME_TIME - 1);
+
+	// The master sends the same frames, at the fade frame rate.
+	setAll(0);
+	frames = mh_hostGetFrameCount();
+	_mu_bytes = 0;
+	for(uint32_t time = FRAME_TIME; time <= FADE_TIME * 1000UL; time += FRAME_TIME){
+		uint8_t data[2 + 3 * MU_LEDS];
+		data[0] = 0x20;
+		memset(data + 1, (uint32_t)255 * time / (FADE_TIME * 1000UL), 3 * MU_LEDS);
+		data[1 + 3 * MU_LEDS] = 0xF5;
+		send(data, sizeof(data));
+		mu_run(FRAME_TIME - (sizeof(data) + 1) * MH_HOST_TWI_BYTE_TIME);
+	}
+	uint32_t frameBytes = _mu_bytes;
+	MU_CHECK(isFrame(255));
+	MU_CHECK(mh_hostGetFrameCount() - frames >= FADE_TIME / MF_FRAME_TIME);
+
+	printf("black to white over %u ms: fade %lu bytes, %lu frames, master frames %lu bytes\n", FADE_TIME,
+		(unsigned long)fadeBytes, (unsigned long)fadeFrames, (unsigned long)frameBytes);
+	MU_CHECK(fadeBytes * 20 < frameBytes);
+
+	// Targets of an incomplete fade command don't change the running fade.
+	setAll(0);
+	fadeAll(255);
+	mu_run(100000);
+	const uint8_t truncated[] = {0xB0, 0x00, 0x01, 0xF4, 0, 0, 0, 0, 0, 0};
+	MU_CHECK(mu_write(truncated, sizeof(truncated)));
+	mu_run(FADE_TIME * 1000UL);
+	MU_CHECK(isFrame(255));
+
+	return mu_end("test_fade");
+}
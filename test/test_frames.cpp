@@ -0,0 +1,154 @@
+//Frame test: staged writes and palette changes never show a torn frame.
+
+#include "moka_test.h"
+
+uint32_t _mu_frames = 0;
+uint32_t _mu_torn = 0;
+
+// Run the loop, checking each frame sent: all leds have the same color.
+void runChecked(uint32_t time){
+	while(time > 0){
+		mh_hostAdvance(MU_LOOP_TIME);
+		time -= MU_LOOP_TIME;
+		loop();
+
+		if(mh_hostGetFrameCount() == _mu_frames){
+			continue;
+		}
+		_mu_frames = mh_hostGetFrameCount();
+
+		const uint8_t *frame = mh_hostGetFrame();
+		for(uint8_t i = 1; i < MU_LEDS; i++){
+			if(memcmp(frame, frame + 3 * i, 3) != 0){
+				_mu_torn++;
+				break;
+			}
+		}
+	}
+}
+
+// Check the last frame: all leds are the GRB color.
+bool isFrame(uint8_t g, uint8_t r, uint8_t b){
+	const uint8_t *frame = mh_hostGetFrame();
+	for(uint8_t i = 0; i < MU_LEDS; i++){
+		if((frame[3 * i] != g) || (frame[3 * i + 1] != r) || (frame[3 * i + 2] != b)){
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(){
+	mu_start();
+	_mu_frames = mh_hostGetFrameCount();
+
+	// Leds are written one by one, with the loop and its refreshes running in between.
+	// The staged frame is only shown on update, so each frame sent is all old or all new.
+	const uint8_t setup24[] = {0x85, 0x50, 0xFF, 0xFF};
+	MU_CHECK(mu_write(setup24, sizeof(setup24)));
+	const uint8_t update = 0xF5;
+
+	for(uint16_t n = 0; n < 100; n++){
+		for(uint8_t i = 0; i < MU_LEDS; i++){
+			uint8_t one[] = {(uint8_t)(0x00 | i), (uint8_t)n, (uint8_t)(n * 3), (uint8_t)(255 - n)};
+			MU_CHECK(mu_write(one, sizeof(one)));
+			runChecked(700);
+			// A brightness change in the middle of the writes makes the front frame sent again, about one per frame.
+			if((i & 0x07) == (n & 0x07)){
+				uint8_t brightness[] = {0x51, (uint8_t)(255 - (i & 0x01))};
+				MU_CHECK(mu_write(brightness, sizeof(brightness)));
+			}
+		}
+		MU_CHECK(mu_write(&update, 1));
+		runChecked(1000);
+	}
+	MU_CHECK(_mu_torn == 0);
+	MU_CHECK(_mu_frames > 150);
+
+	// The next frame is written before the loop runs: the latched frame doesn't get its bytes.
+	const uint8_t fullBrightness[] = {0x51, 255};
+	MU_CHECK(mu_write(fullBrightness, sizeof(fullBrightness)));
+	for(uint8_t n = 0; n < 49; n++){
+		uint8_t value = (n & 0x01) ? 255 : 0;
+		uint8_t all[2 + 3 * MU_LEDS];
+		all[0] = 0x20;
+		memset(all + 1, value, 3 * MU_LEDS);
+		all[1 + 3 * MU_LEDS] = 0xF5;
+		MU_CHECK(mu_write(all, sizeof(all)));
+		uint8_t one[] = {0x00, (uint8_t)~value, (uint8_t)~value, (uint8_t)~value};
+		MU_CHECK(mu_write(one, sizeof(one)));
+		runChecked(1000);
+		MU_CHECK(isFrame(value, value, value));
+	}
+	MU_CHECK(_mu_torn == 0);
+
+	// Two frames latched before the loop runs: the second one is merged into the first, then sent.
+	const uint8_t globalBlack[] = {0x10, 0, 0, 0, 0xF5};
+	const uint8_t oneWhite[] = {0x05, 255, 255, 255, 0xF5};
+	MU_CHECK(mu_write(globalBlack, sizeof(globalBlack)));
+	MU_CHECK(mu_write(oneWhite, sizeof(oneWhite)));
+	mu_run(1000);
+	for(uint8_t i = 0; i < MU_LEDS; i++){
+		MU_CHECK(mh_hostGetFrame()[3 * i] == ((i == 5) ? 255 : 0));
+	}
+	_mu_frames = mh_hostGetFrameCount();
+
+	// Palette mode, with 4 bits indices. Palette 0 is red, 1 is green, full and null channels are the same
+	// after the gamma.
+	const uint8_t paletteMode = 0x86;
+	const uint8_t setPalette[] = {0xC0, 255, 0, 0, 0, 255, 0};
+	MU_CHECK(mu_write(&paletteMode, 1));
+	MU_CHECK(mu_write(setPalette, sizeof(setPalette)));
+
+	const uint8_t allRed[] = {0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xF5};
+	MU_CHECK(mu_write(allRed, sizeof(allRed)));
+	runChecked(20000);
+	MU_CHECK(isFrame(0, 255, 0));
+
+	const uint8_t allGreen[] = {0x20, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0xF5};
+	MU_CHECK(mu_write(allGreen, sizeof(allGreen)));
+	runChecked(20000);
+	MU_CHECK(isFrame(255, 0, 0));
+
+	// A color no led uses changes nothing, on this frame or the next.
+	const uint8_t blue0[] = {0xC0, 0, 0, 255};
+	MU_CHECK(mu_write(blue0, sizeof(blue0)));
+	runChecked(20000);
+	MU_CHECK(isFrame(255, 0, 0));
+
+	const uint8_t oneGreen[] = {0x05, 0x01, 0xF5};
+	MU_CHECK(mu_write(oneGreen, sizeof(oneGreen)));
+	runChecked(20000);
+	MU_CHECK(isFrame(255, 0, 0));
+
+	// A color the leds use is shown on next update.
+	const uint8_t yellow1[] = {0xC1, 255, 255, 0};
+	MU_CHECK(mu_write(yellow1, sizeof(yellow1)));
+	MU_CHECK(mu_write(&update, 1));
+	runChecked(20000);
+	MU_CHECK(isFrame(255, 255, 0));
+
+	MU_CHECK(_mu_torn == 0);
+
+	// A global color then one led in the same frame: the led keeps its own color.
+	const uint8_t globalOne[] = {0x10, 0x00, 0x03, 0x01, 0xF5};
+	MU_CHECK(mu_write(globalOne, sizeof(globalOne)));
+	mu_run(20000);
+	const uint8_t *frame = mh_hostGetFrame();
+	for(uint8_t i = 0; i < MU_LEDS; i++){
+		const uint8_t *color = frame + 3 * i;
+		MU_CHECK((i == 3) ? ((color[0] == 255) && (color[1] == 255) && (color[2] == 0))
+				: ((color[0] == 0) && (color[1] == 0) && (color[2] == 255)));
+	}
+
+	// A filled frame follows its palette color until latched.
+	const uint8_t globalYellow[] = {0x10, 0x01};
+	const uint8_t white1[] = {0xC1, 255, 255, 255};
+	MU_CHECK(mu_write(globalYellow, sizeof(globalYellow)));
+	MU_CHECK(mu_write(white1, sizeof(white1)));
+	MU_CHECK(mu_write(&update, 1));
+	runChecked(20000);
+	MU_CHECK(isFrame(255, 255, 255));
+
+	return mu_end("test_frames");
+}
@@ -0,0 +1,116 @@
+//Host emulation test: address jumpers, keypad and led frames.
+
+#include "moka_test.h"
+
+int main(){
+	// Jumpers set the address, and the board doesn't answer the default one.
+	mh_hostReset();
+	mh_hostSetJumpers(0x03);
+	setup();
+	uint8_t buttons[2];
+	MU_CHECK(mh_hostTwiRead(MU_ADDRESS + 3, buttons, 2));
+	MU_CHECK(!mh_hostTwiRead(MU_ADDRESS, buttons, 2));
+
+	mu_start();
+	MU_CHECK(mu_read(buttons, 2));
+
+	// Key presses reach the buttons once debounced.
+	mh_hostSetKeys(0x8001);
+	mu_run(100000);
+	const uint8_t getButtons = 0x40;
+	MU_CHECK(mu_write(&getButtons, 1));
+	MU_CHECK(mu_read(buttons, 2));
+	MU_CHECK((buttons[0] == 0x80) && (buttons[1] == 0x01));
+
+	mh_hostSetKeys(0);
+	mu_run(100000);
+	MU_CHECK(mu_write(&getButtons, 1));
+	MU_CHECK(mu_read(buttons, 2));
+	MU_CHECK((buttons[0] == 0) && (buttons[1] == 0));
+
+	// HAS_CHANGED tells if key events are waiting, until they are read.
+	const uint8_t hasChanged = 0x83;
+	uint8_t changed;
+	MU_CHECK(mu_write(&hasChanged, 1));
+	MU_CHECK(mu_read(&changed, 1));
+	MU_CHECK(changed == 1);
+	const uint8_t getEvents = 0x90;
+	uint8_t events[2 + 4 * 15];
+	MU_CHECK(mu_write(&getEvents, 1));
+	MU_CHECK(mu_read(events, sizeof(events)));
+	MU_CHECK(events[0] == 4);
+	MU_CHECK(mu_write(&hasChanged, 1));
+	MU_CHECK(mu_read(&changed, 1));
+	MU_CHECK(changed == 0);
+
+	// A 24 bits frame, then a general call update, lights all leds.
+	// Full and null channels are the same after the gamma. Bytes go out as GRB.
+	uint8_t frame[2 + 3 * MU_LEDS];
+	frame[0] = 0x85;
+	frame[1] = 0x20;
+	for(uint8_t i = 0; i < MU_LEDS; i++){
+		frame[2 + 3 * i] = (i & 1) ? 255 : 0;
+		frame[3 + 3 * i] = (i & 2) ? 255 : 0;
+		frame[4 + 3 * i] = (i & 4) ? 255 : 0;
+	}
+	const uint8_t ledState[] = {0x50, 0xFF, 0xFF};
+	const uint8_t update = 0xF5;
+	MU_CHECK(mu_write(ledState, sizeof(ledState)));
+	MU_CHECK(mu_write(frame, sizeof(frame)));
+	uint32_t frames = mh_hostGetFrameCount();
+	MU_CHECK(mh_hostTwiWrite(0, &update, 1));
+	mu_run(20000);
+	MU_CHECK(mh_hostGetFrameCount() > frames);
+
+	const uint8_t *sent = mh_hostGetFrame();
+	for(uint8_t i = 0; i < MU_LEDS; i++){
+		MU_CHECK(sent[3 * i] == frame[3 + 3 * i]);
+		MU_CHECK(sent[3 * i + 1] == frame[2 + 3 * i]);
+		MU_CHECK(sent[3 * i + 2] == frame[4 + 3 * i]);
+	}
+
+	// A general call LATCH is sent on the next loop pass, not when the command task is next due.
+	uint8_t next[2 + 3 * MU_LEDS];
+	next[0] = 0x85;
+	next[1] = 0x20;
+	memset(next + 2, 255, 3 * MU_LEDS);
+	// It's checked at several times from the last run of the command task.
+	const uint8_t latch7[] = {0x8B, 7};
+	for(uint16_t offset = 0; offset < 1000; offset += MU_LOOP_TIME){
+		MU_CHECK(mu_write(next, sizeof(next)));
+		mu_run(2000 + offset);
+		MU_CHECK(mh_hostTwiWrite(0, latch7, sizeof(latch7)));
+		frames = mh_hostGetFrameCount();
+		mu_run(MU_LOOP_TIME);
+		MU_CHECK(mh_hostGetFrameCount() == frames + 1);
+	}
+	sent = mh_hostGetFrame();
+	for(uint8_t i = 0; i < 3 * MU_LEDS; i++){
+		MU_CHECK(sent[i] == 255);
+	}
+
+	// It latches at once: a frame written before the loop runs isn't in it, and the sequence reads back at once.
+	for(uint8_t i = 0; i < MU_LEDS; i++){
+		next[2 + 3 * i] = 0;
+		next[4 + 3 * i] = 0;
+	}
+	MU_CHECK(mu_write(next, sizeof(next)));
+	const uint8_t latch8[] = {0x8B, 8};
+	MU_CHECK(mh_hostTwiWrite(0, latch8, sizeof(latch8)));
+	const uint8_t white[] = {0x10, 255, 255, 255};
+	MU_CHECK(mu_write(white, sizeof(white)));
+
+	const uint8_t getLatch = 0x8C;
+	uint8_t sequence = 0;
+	MU_CHECK(mu_write(&getLatch, 1));
+	MU_CHECK(mu_read(&sequence, 1));
+	MU_CHECK(sequence == 8);
+
+	mu_run(20000);
+	sent = mh_hostGetFrame();
+	for(uint8_t i = 0; i < MU_LEDS; i++){
+		MU_CHECK((sent[3 * i] == 255) && (sent[3 * i + 1] == 0) && (sent[3 * i + 2] == 0));
+	}
+
+	return mu_end("test_host");
+}
@@ -0,0 +1,126 @@
+//Key reaction test: press to frame latency, with a local rule and with a polling master.
+
+#include "moka_test.h"
+#include "moka_react.h"
+
+// Time step of the latency runs, in us.
+const uint16_t STEP = 10;
+const uint8_t KEY = 5;
+
+uint32_t _mu_time;
+
+void step(){
+	mh_hostAdvance(STEP);
+	_mu_time += STEP;
+	loop();
+}
+
+// Whether a frame was sent since the given count, with the key led lit.
+bool isLit(uint32_t frames){
+	if(mh_hostGetFrameCount() == frames){
+		return false;
+	}
+	const uint8_t *frame = mh_hostGetFrame();
+	return frame[3 * KEY] | frame[3 * KEY + 1] | frame[3 * KEY + 2];
+}
+
+// Press the key at the given phase, and get the time until its led is lit, in us. 0 if it never is.
+// With a poll period, the master reads the buttons, then lights the led with SET_ONE_LED and UPDATE_LEDS.
+// Without, the led is lit by a rule on the board.
+uint32_t getLatency(uint32_t poll, uint32_t phase){
+	mu_start();
+	mr_clrRules();
+	mr_update(0);
+	_mu_time = 0;
+
+	const uint8_t ledOn[] = {0x50, 0xFF, 0xFF, 0x10, 0x00, 0xF5};
+	const uint8_t ledOff[] = {0x50, 0x00, 0x00, 0xF5};
+	const uint8_t rule[] = {(uint8_t)(0xD0 | KEY), MR_HOLD | MR_COLOR, 0xFF};
+	if(poll){
+		MU_CHECK(mu_write(ledOn, sizeof(ledOn)));
+	} else {
+		MU_CHECK(mu_write(ledOff, sizeof(ledOff)));
+		MU_CHECK(mu_write(rule, sizeof(rule)));
+	}
+
+	// Settle, then press the key at the given phase of the master polls, or of the scans.
+	while(_mu_time < 50000 + (poll ? 0 : phase)){
+		step();
+	}
+	uint32_t next = _mu_time + phase;
+	uint32_t start = _mu_time;
+	uint32_t frames = mh_hostGetFrameCount();
+	mh_hostSetKeys(1 << KEY);
+
+	uint32_t latency = 0;
+	while(_mu_time - start < 200000){
+		step();
+		if(poll && ((int32_t)(_mu_time - next) >= 0)){
+			next += poll;
+			const uint8_t getButtons = 0x40;
+			uint8_t buttons[2];
+			MU_CHECK(mu_write(&getButtons, 1));
+			MU_CHECK(mu_read(buttons, 2));
+			if(buttons[1] & (1 << KEY)){
+				const uint8_t setOne[] = {KEY, 0xFF, 0xF5};
+				MU_CHECK(mu_write(setOne, sizeof(setOne)));
+				next = _mu_time + 1000000UL;
+			}
+		}
+		if(isLit(frames)){
+			latency = _mu_time - start;
+			break;
+		}
+	}
+
+	mh_hostSetKeys(0);
+	return latency;
+}
+
+struct latency{
+	uint32_t min;
+	uint32_t max;
+	uint32_t average;
+};
+
+// Latency over 20 press phases.
+latency measure(uint32_t poll){
+	uint32_t period = poll ? poll : 1000;
+	latency result = {0xFFFFFFFF, 0, 0};
+	for(uint32_t phase = 0; phase < period; phase += period / 20){
+		uint32_t value = getLatency(poll, phase);
+		MU_CHECK(value != 0);
+		if(value < result.min){
+			result.min = value;
+		}
+		if(value > result.max){
+			result.max = value;
+		}
+		result.average += value;
+	}
+	result.average /= 20;
+
+	if(poll){
+		printf("master poll %5lu us: ", (unsigned long)poll);
+	} else {
+		printf("local rule:             ");
+	}
+	printf("%5lu - %5lu us, %5lu us average\n",
+		(unsigned long)result.min, (unsigned long)result.max, (unsigned long)result.average);
+	return result;
+}
+
+int main(){
+	// With the default 3ms debounce, a rule lights its led within the debounce time and a few scans.
+	latency rule = measure(0);
+	MU_CHECK(rule.max <= 5000);
+
+	// A master polling every 5ms or more is slower on average, and more so as it polls less often.
+	latency poll5 = measure(5000);
+	latency poll10 = measure(10000);
+	MU_CHECK(rule.average < poll5.average);
+	MU_CHECK(rule.max < poll5.max);
+	MU_CHECK(poll5.average < poll10.average);
+
+	return mu_end("test_react");
+}
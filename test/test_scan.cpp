@@ -0,0 +1,157 @@
+//Keypad scan test: rows driven per timer 2 tick, and scan rate.
+
+#include "moka_test.h"
+
+// Readings taken by the loop, counted by the test so it doesn't depend on the stats,
+// and readings replaced by the next scan before the loop took them.
+uint16_t _mu_scans = 0;
+uint16_t _mu_dropped = 0;
+
+// Rows driven now.
+uint8_t getRows(){
+	return MP_ROW_DDR & MP_ROW_MASK;
+}
+
+// Run the loop, then let the time go on. Steps are shorter than a tick, so a scan completes in a step
+// when the last row is released.
+void runTimed(uint32_t time){
+	while(time > 0){
+		bool ready = mp_isScanReady();
+		loop();
+		if(ready && !mp_isScanReady()){
+			_mu_scans++;
+		}
+
+		ready = mp_isScanReady();
+		bool last = (getRows() == _BV(MP_ROWS - 1));
+		mh_hostAdvance(MU_LOOP_TIME);
+		time -= MU_LOOP_TIME;
+		if(ready && last && (getRows() != _BV(MP_ROWS - 1))){
+			_mu_dropped++;
+		}
+	}
+}
+
+// Let the time go on until the driven rows change, one timer 2 count at a time. Returns the time it took.
+uint32_t waitRows(){
+	uint8_t rows = getRows();
+	uint32_t start = micros();
+	while(getRows() == rows){
+		mh_hostAdvance(8);
+	}
+	return micros() - start;
+}
+
+// Each timer 2 tick drives the next row, for one tick, and a scan is a tick per row then idle ticks.
+void checkRows(uint16_t settle, uint8_t ticks){
+	while(getRows() != _BV(0)){
+		waitRows();
+	}
+
+	uint32_t time;
+	for(uint8_t row = 1; row < MP_ROWS; row++){
+		time = waitRows();
+		MU_CHECK(getRows() == _BV(row));
+		MU_CHECK(time == settle);
+	}
+
+	// Idle ticks, with no row driven, until the next scan.
+	time = waitRows();
+	if(ticks > MP_ROWS){
+		MU_CHECK(getRows() == 0);
+		MU_CHECK(time == settle);
+		time = waitRows();
+		MU_CHECK(time == (uint32_t)settle * (ticks - MP_ROWS));
+	} else {
+		MU_CHECK(time == settle);
+	}
+	MU_CHECK(getRows() == _BV(0));
+}
+
+#if MS_STATS
+// Scans read over the last full second.
+uint16_t getScanRate(){
+	uint8_t status[MS_STATUS_SIZE];
+	mu_getStatus(status);
+	return mu_getStatus16(status, 2);
+}
+#endif
+
+// Let the scan rate settle on a new period, and check it: one reading per scan, none dropped.
+void checkScanRate(uint16_t settle, uint8_t ticks, uint32_t period){
+	mp_setSettleTime(settle);
+	mp_setScanTicks(ticks);
+	checkRows(settle, ticks);
+	runTimed(1100000);
+
+	// Readings over a second, counted by the test.
+	_mu_scans = 0;
+	_mu_dropped = 0;
+	runTimed(1000000);
+	uint32_t rate = 1000000UL / period;
+	MU_CHECK((_mu_scans >= rate) && (_mu_scans <= rate + 1));
+	MU_CHECK(_mu_dropped == 0);
+	if((_mu_scans < rate) || (_mu_scans > rate + 1)){
+		fprintf(stderr, "settle %u ticks %u: %u readings, %lu expected\n", settle, ticks, _mu_scans, (unsigned long)rate);
+	}
+
+#if MS_STATS
+	// The scans per second of the status block, over the last full second.
+	runTimed(1000000);
+	uint16_t scans = getScanRate();
+	MU_CHECK((scans >= rate) && (scans <= rate + 1));
+	if((scans < rate) || (scans > rate + 1)){
+		fprintf(stderr, "settle %u ticks %u: %u scans, %lu expected\n", settle, ticks, scans, (unsigned long)rate);
+	}
+#endif
+}
+
+int main(){
+	mu_start();
+
+	// Default: 248us settle time, 4 ticks.
+	checkScanRate(248, 4, 992);
+	checkScanRate(1000, 4, 4000);
+	checkScanRate(248, 16, 3968);
+	// Periods over 65535us.
+	checkScanRate(2048, 32, 65536);
+	checkScanRate(2048, 255, 522240);
+	// Short settle time, still longer than the loop.
+	checkScanRate(96, 4, 384);
+	checkScanRate(248, 4, 992);
+
+	// No reading is dropped while the loop runs, with fades, blink, keys and TWI traffic all going on.
+	const uint8_t setup24[] = {0x85, 0x50, 0xFF, 0xFF, 0x71};
+	MU_CHECK(mu_write(setup24, sizeof(setup24)));
+	uint8_t fade[4 + 3 * MU_LEDS] = {0xB0, 0x01, 0x03, 0xE8};
+	for(uint16_t i = 0; i < 3 * MU_LEDS; i++){
+		fade[4 + i] = i * 5;
+	}
+	const uint8_t update[] = {0xF5};
+	_mu_scans = 0;
+	_mu_dropped = 0;
+	for(uint16_t i = 0; i < 200; i++){
+		mh_hostSetKeys((i & 0x10) ? (1 << (i & 0x0F)) : 0);
+		fade[3] = i;
+		MU_CHECK(mu_write(fade, sizeof(fade)));
+		MU_CHECK(mu_write(update, sizeof(update)));
+		runTimed(5000);
+	}
+	MU_CHECK(_mu_scans >= 1000000UL / 992);
+	MU_CHECK(_mu_dropped == 0);
+
+	// No task misses its deadline. The host master holds the loop during a transaction,
+	// so this is checked with no traffic.
+	MU_CHECK(mu_write(fade, sizeof(fade)));
+	runTimed(MU_LOOP_TIME);
+	mk_resetStats();
+	for(uint16_t i = 0; i < 200; i++){
+		mh_hostSetKeys((i & 0x10) ? (1 << (i & 0x0F)) : 0);
+		runTimed(5000);
+	}
+	for(uint8_t i = 0; i < MK_NUM_TASKS; i++){
+		MU_CHECK(mk_getMisses(i) == 0);
+	}
+
+	return mu_end("test_scan");
+}
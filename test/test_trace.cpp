@@ -0,0 +1,83 @@
+//Trace test: a captured session replays to the same frame, and the report counts what was sent.
+
+#include "moka_test.h"
+#include "moka_trace.h"
+
+int main(){
+	mu_start();
+	FILE *trace = tmpfile();
+	mt_open(trace);
+
+	// Valid frames, in 24 bits.
+	const uint8_t setup24[] = {0x85, 0x50, 0xFF, 0xFF};
+	MU_CHECK(mt_write(trace, MU_ADDRESS, setup24, sizeof(setup24)));
+	uint32_t bytes = sizeof(setup24) + 1;
+
+	uint8_t frame[2 + 3 * MU_LEDS];
+	frame[0] = 0x20;
+	frame[1 + 3 * MU_LEDS] = 0xF5;
+	for(uint8_t n = 0; n < 3; n++){
+		for(uint8_t i = 0; i < 3 * MU_LEDS; i++){
+			frame[1 + i] = (i % 3 == n) ? 255 : 0;
+		}
+		MU_CHECK(mt_write(trace, MU_ADDRESS, frame, sizeof(frame)));
+		bytes += sizeof(frame) + 1;
+		mu_run(20000);
+	}
+
+	// A read no board answers.
+	uint8_t buttons[2];
+	MU_CHECK(!mt_read(trace, MU_ADDRESS + 1, buttons, sizeof(buttons)));
+	bytes += sizeof(buttons) + 1;
+
+	// A truncated frame: the board counts it as malformed.
+	const uint8_t truncated[] = {0x20, 255, 255, 255, 255};
+	MU_CHECK(mt_write(trace, MU_ADDRESS, truncated, sizeof(truncated)));
+	bytes += sizeof(truncated) + 1;
+	mu_run(20000);
+
+	uint8_t captured[3 * NUM_LED];
+	memcpy(captured, mh_hostGetFrame(), sizeof(captured));
+	long size = ftell(trace);
+
+	// Replay to a new board.
+	mu_start();
+	rewind(trace);
+	mt_report report;
+	MU_CHECK(mt_replay(trace, loop, &report));
+	MU_CHECK(report.transactions == 6);
+	MU_CHECK(report.nacks == 1);
+	MU_CHECK(report.bytes == bytes);
+	MU_CHECK(report.busTime == bytes * MH_HOST_TWI_BYTE_TIME);
+	MU_CHECK(report.duration >= 60000);
+#if MS_STATS
+	MU_CHECK(report.malformed == 1);
+#endif
+	MU_CHECK(report.dropped == 0);
+	MU_CHECK(report.frames >= 3);
+	MU_CHECK(memcmp(report.frame, captured, sizeof(captured)) == 0);
+
+	// A trace cut within a record isn't valid, the records before it are replayed.
+	uint8_t data[1024];
+	rewind(trace);
+	MU_CHECK(size <= (long)sizeof(data));
+	MU_CHECK(fread(data, 1, size, trace) == (size_t)size);
+	FILE *cut = tmpfile();
+	fwrite(data, 1, size - 2, cut);
+	rewind(cut);
+	mu_start();
+	MU_CHECK(!mt_replay(cut, loop, &report));
+	MU_CHECK(report.transactions == 5);
+
+	// So isn't a file without the trace header.
+	rewind(cut);
+	fputc('X', cut);
+	rewind(cut);
+	MU_CHECK(!mt_replay(cut, loop, &report));
+	MU_CHECK(report.transactions == 0);
+
+	fclose(cut);
+	fclose(trace);
+
+	return mu_end("test_trace");
+}
@@ -0,0 +1,83 @@
+//TWI slave test: full frames in a single transaction, and incomplete frames dropped.
+
+#include "moka_test.h"
+
+int main(){
+	mu_start();
+
+	const uint8_t setup24[] = {0x85, 0x50, 0xFF, 0xFF};
+	MU_CHECK(mu_write(setup24, sizeof(setup24)));
+	mu_run(1000);
+
+	uint8_t status[MS_STATUS_SIZE];
+	mu_getStatus(status);
+	uint8_t malformed = status[12];
+	uint8_t dropped = status[13];
+
+	// SET_ALL_LED and a 24 bits frame are 49 bytes, more than the 32 bytes the Wire library took.
+	// Each frame is read back from the color registers once updated.
+	uint8_t frame[1 + 3 * MU_LEDS];
+	frame[0] = 0x20;
+	const uint8_t update = 0xF5;
+	const uint8_t readColors[] = {0xE0, 0x00};
+	uint8_t colors[3 * MU_LEDS];
+
+	for(uint16_t n = 0; n < 100; n++){
+		for(uint8_t i = 0; i < 3 * MU_LEDS; i++){
+			frame[1 + i] = n * 7 + i * 3;
+		}
+		MU_CHECK(mu_write(frame, sizeof(frame)));
+		MU_CHECK(mu_write(&update, 1));
+		mu_run(2000);
+
+		MU_CHECK(mu_write(readColors, sizeof(readColors)));
+		MU_CHECK(mu_read(colors, sizeof(colors)));
+		MU_CHECK(memcmp(colors, frame + 1, sizeof(colors)) == 0);
+	}
+
+	// The frame and the update can share the transaction.
+	uint8_t frameUpdate[2 + 3 * MU_LEDS];
+	frameUpdate[0] = 0x20;
+	for(uint8_t i = 0; i < 3 * MU_LEDS; i++){
+		frameUpdate[1 + i] = 255 - i;
+	}
+	frameUpdate[1 + 3 * MU_LEDS] = update;
+	uint32_t frames = mh_hostGetFrameCount();
+	MU_CHECK(mu_write(frameUpdate, sizeof(frameUpdate)));
+	mu_run(2000);
+	MU_CHECK(mh_hostGetFrameCount() == frames + 1);
+	MU_CHECK(mu_write(readColors, sizeof(readColors)));
+	MU_CHECK(mu_read(colors, sizeof(colors)));
+	MU_CHECK(memcmp(colors, frameUpdate + 1, sizeof(colors)) == 0);
+
+	// A batch of settings ending with UPDATE_LEDS, in one transaction. The update is never dropped.
+	// The brightness changes each time, so each update sends a frame.
+	uint8_t batch[] = {0x50, 0xFF, 0xFF, 0x61, 0x70, 0x51, 200, 0x80, 0x01, 0xF4,
+		0x81, 0x01, 0xF4, 0x82, 3, 0x8A, 0x00, 0x00, 0xF5};
+	for(uint8_t n = 0; n < 10; n++){
+		batch[6] = 200 + n;
+		frames = mh_hostGetFrameCount();
+		MU_CHECK(mu_write(batch, sizeof(batch)));
+		mu_run(2000);
+		MU_CHECK(mh_hostGetFrameCount() == frames + 1);
+	}
+
+	mu_getStatus(status);
+	MU_CHECK(status[12] == malformed);
+	MU_CHECK(status[13] == dropped);
+
+	// An incomplete frame is dropped: the leds it reached don't take its bytes on the next update.
+	const uint8_t incomplete[] = {0x20, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+	MU_CHECK(mu_write(incomplete, sizeof(incomplete)));
+	const uint8_t deltaUpdate[] = {0x30, 0x04, 0x00, 10, 20, 30, 0xF5};
+	MU_CHECK(mu_write(deltaUpdate, sizeof(deltaUpdate)));
+	mu_run(2000);
+	MU_CHECK(mu_write(readColors, sizeof(readColors)));
+	MU_CHECK(mu_read(colors, sizeof(colors)));
+	memcpy(frameUpdate + 1 + 3 * 10, deltaUpdate + 3, 3);
+	MU_CHECK(memcmp(colors, frameUpdate + 1, sizeof(colors)) == 0);
+	mu_getStatus(status);
+	MU_CHECK(status[12] == malformed + 1);
+
+	return mu_end("test_twi");
+}